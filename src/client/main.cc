@@ -6,13 +6,17 @@
 #include <string.h>
 
 #include <iostream>
+#include <string>
 
 #include "common/config.h"
 #include "common/constants.h"
 #include "common/result.h"
 #include "common/scoped_ptr.h"
 #include "common/time.h"
+#include "common/timestamping.h"
 #include "common/traffic_data.h"
+#include "client/record_sender.h"
+#include "client/udp_receiver.h"
 #include "gflags/gflags.h"
 #include "mlab/client_socket.h"
 #include "mlab/mlab.h"
@@ -34,9 +38,25 @@ DEFINE_int32(maxrate, 1200, "The maximum rate to test when --sweep is active.");
 DEFINE_int32(ratestep, 100, "The step to take between rates when --sweep is "
                             "active.");
 DEFINE_bool(verbose, false, "Verbose output");
+DEFINE_bool(stream_records, true, "Send receive records to the server during "
+                                  "the test rather than all of them at the "
+                                  "end");
+DEFINE_bool(compact_records, true, "Send receive records in the compact "
+                                   "encoding");
+DEFINE_string(rx_timestamps, "software", "Use the kernel's receive timestamps "
+                                         "for UDP: 'none', 'software' or "
+                                         "'hardware'");
+DEFINE_string(clock, "system", "The clock for timestamps and pacing: "
+                               "'system' or 'tsc'");
 
 namespace mbm {
 namespace {
+const int kUdpReceiveBufferBytes = 4 * 1024 * 1024;
+// With --stream_records, records are sent once this many have been collected
+// or kStreamIntervalNs after the last batch, whichever comes first.
+const uint32_t kStreamBatchRecords = 4096;
+const uint64_t kStreamIntervalNs = 100 * 1000 * 1000;
+
 bool ValidatePort(const char* flagname, int32_t value) {
   if (value > 0 && value < 65536)
     return true;
@@ -58,12 +78,44 @@ bool ValidateBurstSize(const char* flagname, const int32_t value) {
   return false;
 }
 
+bool ValidateTimestamps(const char* flagname, const std::string& value) {
+  TimestampingMode mode;
+  if (ParseTimestampingMode(value, &mode))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+bool ValidateClock(const char* flagname, const std::string& value) {
+  ClockSource source;
+  if (ParseClockSource(value, &source))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+void PrintRecords(const std::vector<TrafficData>& records) {
+  for (std::vector<TrafficData>::const_iterator it = records.begin();
+       it != records.end(); ++it) {
+    std::cout << "  seq_no: " << std::hex << it->seq_no() << " "
+              << std::dec << it->seq_no() << "\n";
+    std::cout << "  nonce: " << std::hex << it->nonce() << " "
+              << std::dec << it->nonce() << "\n";
+    std::cout << "  timestamp: " << std::hex << it->timestamp() << " "
+              << std::dec << it->timestamp() << "\n";
+  }
+}
+
 const bool port_validator =
     gflags::RegisterFlagValidator(&FLAGS_port, &ValidatePort);
 const bool socket_type_validator =
     gflags::RegisterFlagValidator(&FLAGS_socket_type, &ValidateSocketType);
 const bool burst_size_validator = 
     gflags::RegisterFlagValidator(&FLAGS_burst_size, &ValidateBurstSize);
+const bool rx_timestamps_validator =
+    gflags::RegisterFlagValidator(&FLAGS_rx_timestamps, &ValidateTimestamps);
+const bool clock_validator =
+    gflags::RegisterFlagValidator(&FLAGS_clock, &ValidateClock);
 
 Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
   std::cout.setf(std::ios_base::fixed);
@@ -90,18 +142,54 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
   assert(set_result != -1);
 
   std::cout << "Sending config\n";
-  const Config config(socket_type, rate, rtt, mss, burst_size);
+  uint32_t features = FEATURE_SESSION_TOKEN;
+  if (FLAGS_stream_records)
+    features |= FEATURE_STREAM_RECORDS;
+  if (FLAGS_compact_records)
+    features |= FEATURE_COMPACT_RECORDS;
+  const Config config(socket_type, rate, rtt, mss, burst_size, features);
+  ctrl_socket->SendOrDie(mlab::Packet(htonl(kProtocolHello)));
   ctrl_socket->SendOrDie(mlab::Packet(config));
 
+  // A server that doesn't know about hellos takes ours for a bad Config and
+  // hangs up.
+  ssize_t bytes_read;
+  mlab::Packet hello_pkt = ctrl_socket->ReceiveX(sizeof(uint32_t), &bytes_read);
+  uint32_t hello = 0;
+  if (bytes_read >= 0 && static_cast<unsigned>(bytes_read) >= sizeof(hello))
+    hello = ntohl(hello_pkt.as<uint32_t>());
+  if ((hello & kProtocolMagicMask) != kProtocolMagic) {
+    std::cerr << "The server didn't answer the hello. It may speak an older "
+              << "protocol than version " << kProtocolVersion << ".\n";
+    return RESULT_ERROR;
+  }
+  if (hello != kProtocolHello) {
+    std::cerr << "The server speaks protocol version "
+              << (hello & ~kProtocolMagicMask) << ", not "
+              << kProtocolVersion << ".\n";
+    return RESULT_ERROR;
+  }
+
   std::cout << "Getting port\n";
   uint16_t port =
       ntohs(ctrl_socket->ReceiveOrDie(sizeof(uint16_t)).as<uint16_t>());
+  uint32_t token =
+      ntohl(ctrl_socket->ReceiveOrDie(sizeof(uint32_t)).as<uint32_t>());
 
   std::cout << "Connecting on port " << port << "\n";
   // Create a new socket based on config.
   scoped_ptr<mlab::ClientSocket> mbm_socket(
       mlab::ClientSocket::CreateOrDie(server, port, socket_type));
 
+  // On a shared port the server finds our session by the token in front of
+  // READY.
+  std::string test_ready(READY);
+  if (token != 0) {
+    uint32_t token_n = htonl(token);
+    test_ready.insert(0, reinterpret_cast<const char*>(&token_n),
+                      sizeof(token_n));
+  }
+
   std::cout << "Sending READY\n";
   ctrl_socket->SendOrDie(mlab::Packet(READY, strlen(READY)));
 
@@ -124,7 +212,7 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
   // send ready on the test channel and wait for ready on the ctrl channel
   ssize_t num_bytes;
   for(int count = 0; count < NUM_READY_RETRANS; ++count) {
-    mbm_socket->SendOrDie(mlab::Packet(READY, strlen(READY)));
+    mbm_socket->SendOrDie(mlab::Packet(test_ready.data(), test_ready.size()));
     if (ctrl_socket->Receive(strlen(READY), &num_bytes).str() == READY)
       break;
     // if failed to receive ready with loop, terminate the test
@@ -137,7 +225,6 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
   // Expect test to start now. Server drives the test by picking a CBR and
   // sending data at that rate while counting losses. All we need to do is
   // receive and dump the data.
-  ssize_t bytes_read;
   const uint32_t chunk_len = ntohl(
       ctrl_socket->ReceiveX(sizeof(chunk_len), &bytes_read).as<uint32_t>());
   if (bytes_read < 0 || static_cast<unsigned>(bytes_read) < sizeof(chunk_len)) {
@@ -145,6 +232,10 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
               << strerror(errno) << "\n";
     return RESULT_ERROR;
   }
+  if (chunk_len == 0) {
+    std::cerr << "The server is too busy to run the test. Try again later.\n";
+    return RESULT_ERROR;
+  }
   const uint32_t max_num_pkt = ntohl(
       ctrl_socket->ReceiveX(sizeof(max_num_pkt), &bytes_read).as<uint32_t>());
   if (bytes_read < 0
@@ -167,9 +258,39 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
             << max_num_pkt * chunk_len << " bytes)\n";
   std::cout << "the process takes at most " << max_time_sec << " seconds\n";
 
+  // Streamed records only wait here until the next batch goes out.
   std::vector<TrafficData> data_collected;
+  RecordSender sender(ctrl_socket.get(), FLAGS_compact_records);
+  data_collected.reserve(FLAGS_stream_records ?
+                         kStreamBatchRecords + kStreamBatchRecords / 2 :
+                         max_num_pkt);
+  uint64_t next_stream_time = GetTimeNS() + kStreamIntervalNs;
+
+  // UDP is read in batches. Make room for a burst or two in the socket
+  // buffer so that we don't drop what the network delivered.
+  scoped_ptr<UdpReceiver> receiver(NULL);
+  if (socket_type == SOCKETTYPE_UDP) {
+    TimestampingMode timestamping = TIMESTAMPING_NONE;
+    ParseTimestampingMode(FLAGS_rx_timestamps, &timestamping);
+    receiver.reset(new UdpReceiver(mbm_socket->raw(), chunk_len,
+                                   timestamping));
+    int rcvbuf = kUdpReceiveBufferBytes;
+    setsockopt(mbm_socket->raw(), SOL_SOCKET, SO_RCVBUF,
+               &rcvbuf, sizeof(rcvbuf));
+  }
+
   fd_set fds; 
   while (true) {
+    if (FLAGS_stream_records && !data_collected.empty() &&
+        (data_collected.size() >= kStreamBatchRecords ||
+         GetTimeNS() >= next_stream_time)) {
+      if (FLAGS_verbose)
+        PrintRecords(data_collected);
+      sender.Send(data_collected);
+      data_collected.clear();
+      next_stream_time = GetTimeNS() + kStreamIntervalNs;
+    }
+
     FD_ZERO(&fds);
     FD_SET(ctrl_socket->raw(), &fds);
     FD_SET(mbm_socket->raw(), &fds);
@@ -180,9 +301,15 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
     if (FD_ISSET(ctrl_socket->raw(), &fds) != 0) {
       std::string msg = ctrl_socket->ReceiveOrDie(sizeof(END)).str();
       std::cout << "Received END" << std::endl;
+      // Whatever arrived before END still counts.
+      if (receiver.get() && !receiver->Drain(&data_collected))
+        return RESULT_ERROR;
       break;
     }
-    if (FD_ISSET(mbm_socket->raw(), &fds) != 0) {
+    if (receiver.get() && FD_ISSET(mbm_socket->raw(), &fds) != 0) {
+      if (!receiver->Drain(&data_collected))
+        return RESULT_ERROR;
+    } else if (FD_ISSET(mbm_socket->raw(), &fds) != 0) {
       mlab::Packet recv = mbm_socket->ReceiveX(chunk_len, &bytes_read);
       uint32_t seq_no = ntohl(recv.as<uint32_t>());
       uint64_t timestamp = GetTimeNS();
@@ -198,43 +325,20 @@ Result Run(SocketType socket_type, int rate, int rtt, int mss, int burst_size) {
   }
 
 
-  if (FLAGS_verbose) {
-    for (std::vector<TrafficData>::const_iterator it = data_collected.begin();
-         it != data_collected.end(); ++it) {
-      std::cout << "  seq_no: " << std::hex << it->seq_no() << " "
-                << std::dec << it->seq_no() << "\n";
-      std::cout << "  nonce: " << std::hex << it->nonce() << " "
-                << std::dec << it->nonce() << "\n";
-      std::cout << "  timestamp: " << std::hex << it->timestamp() << " "
-                << std::dec << it->timestamp() << "\n";
-    }
-  }
-
-  // Send the collected data back to the server
-  uint32_t data_size_obj = data_collected.size();
-  ctrl_socket->SendOrDie(mlab::Packet(htonl(data_size_obj)));
-  uint32_t data_size_bytes = data_size_obj * sizeof(TrafficData);
-
-
-  std::vector<TrafficData> send_buffer(data_size_obj);
-  for (uint32_t i=0; i<data_size_obj; ++i) {
-    send_buffer[i] = TrafficData::hton(data_collected[i]);
-  }
-
+  // Send the collected data back to the server. A streaming upload ends
+  // with an empty batch.
   std::cout << "Sending collected data..." << std::endl;
-  uint32_t offset = 0;
-  const char* send_buffer_ptr = reinterpret_cast<const char*>(&send_buffer[0]);
-  while (offset < data_size_bytes) {
-    uint32_t num_to_send = std::min(static_cast<unsigned>(500000),
-                                    data_size_bytes - offset);
-    ctrl_socket->Send(
-      mlab::Packet(&send_buffer_ptr[offset], num_to_send),
-                   &num_bytes);
-    assert(num_bytes >= 0);
-    offset += num_bytes; 
+  if (FLAGS_verbose)
+    PrintRecords(data_collected);
+  sender.Send(data_collected);
+  if (FLAGS_stream_records && !data_collected.empty())
+    sender.Send(std::vector<TrafficData>());
+  std::cout << "sent " << sender.bytes_sent() << " bytes of records\n";
+  if (receiver.get() && FLAGS_rx_timestamps == "hardware") {
+    std::cout << receiver->hardware_timestamps()
+              << " records timestamped by the device\n";
   }
 
-
   std::cout << "Receiving test result" << std::endl;
   Result result;
   mlab::Packet result_pkt = ctrl_socket->ReceiveX(sizeof(result), &bytes_read);
@@ -261,6 +365,17 @@ int main(int argc, char* argv[]) {
     mlab::SetLogSeverity(mlab::VERBOSE);
   gflags::SetVersionString(MBM_VERSION);
 
+  using namespace mbm;
+  ClockSource clock = CLOCK_SOURCE_SYSTEM;
+  ParseClockSource(FLAGS_clock, &clock);
+  if (SetClockSource(clock) != clock)
+    std::cout << "TSC clock not usable, using the system clock\n";
+  if (GetClockSource() == CLOCK_SOURCE_TSC) {
+    int64_t error_ns, max_error_ns;
+    GetClockError(&error_ns, &max_error_ns);
+    std::cout << "TSC clock calibrated, " << error_ns << " ns off\n";
+  }
+
   if (FLAGS_sweep) {
     // Do UDP sweep and then TCP test.
     int rate = FLAGS_minrate;
@@ -0,0 +1,61 @@
+#include "client/record_sender.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "mlab/client_socket.h"
+
+namespace mbm {
+namespace {
+// Largest single write on the control socket.
+const uint32_t kMaxSendBytes = 500000;
+
+void PutUint32(std::vector<uint8_t>* buffer, size_t offset, uint32_t value) {
+  value = htonl(value);
+  memcpy(&(*buffer)[offset], &value, sizeof(value));
+}
+}  // namespace
+
+RecordSender::RecordSender(const mlab::ClientSocket* ctrl_socket,
+                           bool compact)
+    : ctrl_socket_(ctrl_socket),
+      compact_(compact),
+      bytes_sent_(0) {
+}
+
+void RecordSender::Send(const std::vector<TrafficData>& records) {
+  // The header is filled in once the size of what follows is known.
+  const size_t header_bytes = (compact_ ? 3 : 1) * sizeof(uint32_t);
+  buffer_.resize(header_bytes);
+  PutUint32(&buffer_, 0, records.size());
+  if (compact_) {
+    uint32_t checksum = encoder_.Encode(records, &buffer_);
+    PutUint32(&buffer_, sizeof(uint32_t), buffer_.size() - header_bytes);
+    PutUint32(&buffer_, 2 * sizeof(uint32_t), checksum);
+  } else {
+    buffer_.resize(header_bytes + records.size() * sizeof(TrafficData));
+    if (!records.empty()) {
+      TrafficData* raw = reinterpret_cast<TrafficData*>(&buffer_[header_bytes]);
+      memcpy(raw, &records[0], records.size() * sizeof(TrafficData));
+      TrafficData::hton(raw, records.size());
+    }
+  }
+
+  size_t offset = 0;
+  const char* buffer_ptr = reinterpret_cast<const char*>(&buffer_[0]);
+  while (offset < buffer_.size()) {
+    uint32_t num_to_send = std::min(static_cast<size_t>(kMaxSendBytes),
+                                    buffer_.size() - offset);
+    ssize_t num_bytes;
+    ctrl_socket_->Send(mlab::Packet(&buffer_ptr[offset], num_to_send),
+                       &num_bytes);
+    assert(num_bytes >= 0);
+    offset += num_bytes;
+  }
+  bytes_sent_ += buffer_.size();
+}
+
+}  // namespace mbm
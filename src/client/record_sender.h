@@ -0,0 +1,36 @@
+#ifndef CLIENT_RECORD_SENDER_H
+#define CLIENT_RECORD_SENDER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "common/record_codec.h"
+#include "common/traffic_data.h"
+
+namespace mlab {
+class ClientSocket;
+}  // namespace mlab
+
+namespace mbm {
+
+// Sends receive records to the server in batches, raw or in the compact
+// encoding. The framing is described in server/record_reader.h.
+class RecordSender {
+  public:
+    RecordSender(const mlab::ClientSocket* ctrl_socket, bool compact);
+    // Sends records as one batch; an empty one ends a streaming upload.
+    void Send(const std::vector<TrafficData>& records);
+    uint64_t bytes_sent() const { return bytes_sent_; }
+
+  private:
+    const mlab::ClientSocket* ctrl_socket_;
+    bool compact_;
+    uint64_t bytes_sent_;
+    RecordEncoder encoder_;
+    std::vector<uint8_t> buffer_;
+};
+
+}  // namespace mbm
+
+#endif  // CLIENT_RECORD_SENDER_H
@@ -0,0 +1,102 @@
+#include "client/udp_receiver.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "common/time.h"
+
+namespace mbm {
+namespace {
+// Datagrams read per recvmmsg call.
+const uint32_t kBatchSize = 64;
+}  // namespace
+
+UdpReceiver::UdpReceiver(int fd, uint32_t chunk_len,
+                         TimestampingMode timestamping)
+    : fd_(fd),
+      chunk_len_(chunk_len),
+      timestamping_(timestamping != TIMESTAMPING_NONE &&
+                    EnableTimestamping(fd, timestamping, false)),
+      batch_size_(timestamping_ ? kBatchSize : 1),
+      clock_fd_(-1),
+      hardware_timestamps_(0),
+      control_bytes_(timestamping_ ? TimestampingControlBytes() : 0),
+      buffers_(kBatchSize * chunk_len),
+      control_(kBatchSize * control_bytes_),
+      iovecs_(kBatchSize),
+      msgs_(kBatchSize) {
+  for (uint32_t i = 0; i < kBatchSize; ++i) {
+    iovecs_[i].iov_base = &buffers_[i * chunk_len_];
+    iovecs_[i].iov_len = chunk_len_;
+    memset(&msgs_[i], 0, sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+    if (timestamping_)
+      msgs_[i].msg_hdr.msg_control = &control_[i * control_bytes_];
+  }
+  if (timestamping_ && timestamping == TIMESTAMPING_HARDWARE) {
+    clock_fd_ = OpenHardwareClock(fd);
+    if (clock_fd_ < 0)
+      std::cout << "No hardware clock found, using software timestamps\n";
+  }
+}
+
+UdpReceiver::~UdpReceiver() {
+  if (clock_fd_ >= 0)
+    close(clock_fd_);
+}
+
+bool UdpReceiver::Drain(std::vector<TrafficData>* data) {
+  while (true) {
+    // The kernel shrinks msg_controllen to what it used.
+    for (uint32_t i = 0; timestamping_ && i < batch_size_; ++i)
+      msgs_[i].msg_hdr.msg_controllen = control_bytes_;
+    int received = recvmmsg(fd_, &msgs_[0], batch_size_, MSG_DONTWAIT, NULL);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      std::cerr << "recvmmsg failed: " << strerror(errno) << "\n";
+      return false;
+    }
+
+    // Without kernel timestamps only one datagram is read at a time, so each
+    // still gets its own clock read.
+    uint64_t read_timestamp = GetTimeNS();
+    int64_t realtime_offset_ns = timestamping_ ? GetRealtimeOffsetNS() : 0;
+    int64_t hardware_offset_ns;
+    const bool hardware = clock_fd_ >= 0 &&
+                          GetHardwareOffsetNS(clock_fd_, &hardware_offset_ns);
+    for (int i = 0; i < received; ++i) {
+      if (msgs_[i].msg_len < chunk_len_) {
+        std::cerr << "Something went wrong. The server might have died: "
+                  << "short datagram\n";
+        return false;
+      }
+      const char* chunk = &buffers_[i * chunk_len_];
+      uint32_t header[2];
+      memcpy(header, chunk, sizeof(header));
+      uint64_t timestamp = 0;
+      bool hardware_used = false;
+      if (timestamping_)
+        timestamp = GetTimestamp(&msgs_[i].msg_hdr, realtime_offset_ns,
+                                 hardware ? &hardware_offset_ns : NULL,
+                                 &hardware_used);
+      if (hardware_used)
+        ++hardware_timestamps_;
+      if (timestamp == 0)
+        timestamp = read_timestamp;
+      data->push_back(TrafficData(ntohl(header[0]), ntohl(header[1]),
+                                  timestamp));
+    }
+    if (static_cast<uint32_t>(received) < batch_size_)
+      return true;
+  }
+}
+
+}  // namespace mbm
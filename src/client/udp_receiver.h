@@ -0,0 +1,50 @@
+#ifndef CLIENT_UDP_RECEIVER_H
+#define CLIENT_UDP_RECEIVER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include "common/timestamping.h"
+#include "common/traffic_data.h"
+
+namespace mbm {
+
+// Drains a UDP test socket with recvmmsg into a fixed ring of chunk buffers
+// and records each datagram straight from its buffer. With kernel timestamps
+// each datagram carries its own arrival time, so a whole batch is read per
+// syscall; without them datagrams are read and clock-stamped one at a time,
+// so a batch never shares one arrival time.
+class UdpReceiver {
+  public:
+    UdpReceiver(int fd, uint32_t chunk_len, TimestampingMode timestamping);
+    ~UdpReceiver();
+    // Appends a record for every datagram waiting on the socket. Returns
+    // false if the socket fails or a datagram is short.
+    bool Drain(std::vector<TrafficData>* data);
+    // How many datagrams the device stamped.
+    uint32_t hardware_timestamps() const { return hardware_timestamps_; }
+
+  private:
+    UdpReceiver(const UdpReceiver&);
+    UdpReceiver& operator=(const UdpReceiver&);
+
+    int fd_;
+    uint32_t chunk_len_;
+    bool timestamping_;
+    uint32_t batch_size_;
+    // The device clock hardware timestamps are on, or -1 to use software
+    // ones only.
+    int clock_fd_;
+    uint32_t hardware_timestamps_;
+    size_t control_bytes_;
+    std::vector<char> buffers_;
+    std::vector<char> control_;
+    std::vector<iovec> iovecs_;
+    std::vector<mmsghdr> msgs_;
+};
+
+}  // namespace mbm
+
+#endif  // CLIENT_UDP_RECEIVER_H
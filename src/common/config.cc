@@ -15,16 +15,19 @@ Config::Config()
       cbr_kb_s(0),
       rtt_ms(0),
       mss_bytes(0),
-      burst_size(1) {
+      burst_size(1),
+      features(0) {
 }
 
 Config::Config(SocketType socket_type, uint32_t cbr_kb_s,
-               uint32_t rtt_ms, uint32_t mss_bytes, uint32_t burst_size)
+               uint32_t rtt_ms, uint32_t mss_bytes, uint32_t burst_size,
+               uint32_t features)
     : socket_type(socket_type),
       cbr_kb_s(cbr_kb_s),
       rtt_ms(rtt_ms),
       mss_bytes(mss_bytes),
-      burst_size(burst_size) {
+      burst_size(burst_size),
+      features(features) {
 }
 
 }  // namespace mbm
@@ -7,17 +7,43 @@
 #include "mlab/socket_type.h"
 
 namespace mbm {
+// Clients that send features start the handshake with kProtocolHello, in
+// network order, ahead of their Config, and the server answers with its own
+// ahead of the port. Older clients send a Config without the features word
+// and get no hello back; their Config starts with the socket type, which
+// never looks like a hello. Peers that speak different versions hang up.
+const uint32_t kProtocolMagic = 0x4d424d00;  // "MBM\0"
+const uint32_t kProtocolMagicMask = 0xffffff00;
+const uint32_t kProtocolVersion = 1;
+const uint32_t kProtocolHello = kProtocolMagic | kProtocolVersion;
+
+// Optional parts of the wire protocol. The client sets the ones it supports
+// in Config::features; the server only uses those.
+enum Feature {
+  // The server may answer the Port message with a session token, to be sent
+  // ahead of READY on a test port shared by all sessions.
+  FEATURE_SESSION_TOKEN = 1 << 0,
+  // The client sends its receive records in batches during the test, and an
+  // empty batch after END, instead of all of them after END.
+  FEATURE_STREAM_RECORDS = 1 << 1,
+  // Receive records are sent in the compact encoding of record_codec.h.
+  FEATURE_COMPACT_RECORDS = 1 << 2
+};
+
 class Config {
  public:
   Config();
   Config(SocketType socket_type, uint32_t cbr_kb_s,
-         uint32_t rtt_ms, uint32_t mss_bytes, uint32_t burst_size);
+         uint32_t rtt_ms, uint32_t mss_bytes, uint32_t burst_size,
+         uint32_t features);
 
   SocketType socket_type;
   uint32_t cbr_kb_s;
   uint32_t rtt_ms;
   uint32_t mss_bytes;
   uint32_t burst_size;
+  // Last, so that the Config of a client without features is the rest.
+  uint32_t features;
 };
 }  // namespace mbm
 
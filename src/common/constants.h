@@ -1,7 +1,7 @@
 #ifndef COMMON_CONSTANTS_H_
 #define COMMON_CONSTANTS_H_
 
-#define MBM_VERSION "0.5"
+#define MBM_VERSION "0.6"
 #define READY       "READY"
 #define END         "END"
 
@@ -25,5 +25,7 @@
 #define DEFAULT_TYPE_I_ERR 0.05
 #define DEFAULT_TYPE_II_ERR 0.05
 #define MAX_RECV_BYTES 500000
+#define MIN_BURST_NS 1000000
+#define MIN_BURST_SPIN_NS 250000
 
 #endif  // COMMON_CONSTANTS_H_
@@ -0,0 +1,286 @@
+#include "common/log_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace mbm {
+namespace {
+const char kMagic[8] = {'M', 'B', 'M', 'L', 'O', 'G', '\0', '\0'};
+const uint32_t kVersion = 1;
+// Read back as something else when the reader's byte order differs.
+const uint32_t kByteOrderMark = 0x01020304;
+
+// The column offsets are server seq_no, nonce, timestamp, then the same for
+// the client.
+const int kNumColumns = 6;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t testdata_offset;
+  uint64_t testdata_size;
+  uint64_t server_records;
+  uint64_t client_records;
+  uint64_t column_offsets[kNumColumns];
+};
+
+uint64_t Align(uint64_t offset) {
+  return (offset + 7) & ~static_cast<uint64_t>(7);
+}
+
+void AddColumn(const void* data, uint64_t bytes, uint64_t* offset,
+               uint64_t* column_offset, std::vector<iovec>* iov) {
+  static const char kPadding[8] = {0};
+  uint64_t aligned = Align(*offset);
+  if (aligned > *offset) {
+    iovec pad = {const_cast<char*>(kPadding), aligned - *offset};
+    iov->push_back(pad);
+  }
+  *column_offset = aligned;
+  if (bytes > 0) {
+    iovec column = {const_cast<void*>(data), bytes};
+    iov->push_back(column);
+  }
+  *offset = aligned + bytes;
+}
+
+template <typename T>
+const void* Data(const std::vector<T>& column) {
+  return column.empty() ? NULL : &column[0];
+}
+}  // namespace
+
+void RecordColumns::Append(uint32_t seq_no_value, uint32_t nonce_value,
+                           uint64_t timestamp_value) {
+  seq_no.push_back(seq_no_value);
+  nonce.push_back(nonce_value);
+  timestamp.push_back(timestamp_value);
+}
+
+void RecordColumns::Reserve(size_t count) {
+  seq_no.reserve(count);
+  nonce.reserve(count);
+  timestamp.reserve(count);
+}
+
+std::string LogDirectory(const timespec& time) {
+  struct tm time_tm;
+  gmtime_r(&time.tv_sec, &time_tm);
+  char buffer[20];
+  strftime(buffer, sizeof(buffer), "/%Y/%m/%d/", &time_tm);
+  return buffer;
+}
+
+std::string LogName(const timespec& time) {
+  struct tm time_tm;
+  gmtime_r(&time.tv_sec, &time_tm);
+  char buffer[20];
+  strftime(buffer, sizeof(buffer), "%Y%m%dT%T.", &time_tm);
+  std::stringstream ss;
+  ss << buffer << time.tv_nsec << 'Z';
+  return ss.str();
+}
+
+ColumnView RecordColumns::view() const {
+  ColumnView view = {size(), static_cast<const uint32_t*>(Data(seq_no)),
+                     static_cast<const uint32_t*>(Data(nonce)),
+                     static_cast<const uint64_t*>(Data(timestamp))};
+  return view;
+}
+
+bool WriteTextRecords(const std::string& path, const ColumnView& records) {
+  std::ofstream fs(path.c_str());
+  for (size_t i = 0; i < records.size; ++i) {
+    fs << records.seq_no[i] << ' ' << records.nonce[i]
+       << ' ' << records.timestamp[i] << '\n';
+  }
+  fs.close();
+  if (!fs) {
+    std::cerr << "failed to write " << path << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool WriteLog(int fd, const std::string& testdata,
+              const RecordColumns& server, const RecordColumns& client,
+              uint64_t* size) {
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byte_order = kByteOrderMark;
+  header.server_records = server.size();
+  header.client_records = client.size();
+
+  std::vector<iovec> iov;
+  iovec header_iov = {&header, sizeof(header)};
+  iov.push_back(header_iov);
+  uint64_t offset = sizeof(header);
+  header.testdata_offset = offset;
+  header.testdata_size = testdata.size();
+  if (!testdata.empty()) {
+    iovec testdata_iov = {const_cast<char*>(testdata.data()), testdata.size()};
+    iov.push_back(testdata_iov);
+    offset += testdata.size();
+  }
+
+  const RecordColumns* sides[2] = {&server, &client};
+  for (int i = 0; i < 2; ++i) {
+    const RecordColumns& side = *sides[i];
+    AddColumn(Data(side.seq_no), side.size() * sizeof(uint32_t), &offset,
+              &header.column_offsets[3 * i], &iov);
+    AddColumn(Data(side.nonce), side.size() * sizeof(uint32_t), &offset,
+              &header.column_offsets[3 * i + 1], &iov);
+    AddColumn(Data(side.timestamp), side.size() * sizeof(uint64_t), &offset,
+              &header.column_offsets[3 * i + 2], &iov);
+  }
+  // Pad the end too, so that a log appended after this one is aligned.
+  uint64_t end;
+  AddColumn(NULL, 0, &offset, &end, &iov);
+
+  // writev() may stop short; pick up where it left off.
+  size_t next = 0;
+  while (next < iov.size()) {
+    size_t count = std::min(iov.size() - next, static_cast<size_t>(IOV_MAX));
+    ssize_t written = writev(fd, &iov[next], count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    while (next < iov.size() &&
+           static_cast<size_t>(written) >= iov[next].iov_len) {
+      written -= iov[next].iov_len;
+      ++next;
+    }
+    if (written > 0) {
+      iov[next].iov_base = static_cast<char*>(iov[next].iov_base) + written;
+      iov[next].iov_len -= written;
+    }
+  }
+  *size = end;
+  return true;
+}
+
+bool WriteLogFile(const std::string& path, const std::string& testdata,
+                  const RecordColumns& server, const RecordColumns& client) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "failed to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  uint64_t size;
+  if (!WriteLog(fd, testdata, server, client, &size) || close(fd) != 0) {
+    std::cerr << "failed to write " << path << ": " << strerror(errno) << "\n";
+    close(fd);
+    return false;
+  }
+  return true;
+}
+
+LogFile::LogFile()
+    : map_(MAP_FAILED),
+      map_size_(0),
+      base_(NULL),
+      size_(0),
+      testdata_(NULL),
+      testdata_size_(0) {
+  memset(&server_, 0, sizeof(server_));
+  memset(&client_, 0, sizeof(client_));
+}
+
+LogFile::~LogFile() {
+  if (map_ != MAP_FAILED)
+    munmap(map_, map_size_);
+}
+
+bool LogFile::Open(const std::string& path) {
+  return Open(path, 0, 0);
+}
+
+bool LogFile::Open(const std::string& path, uint64_t offset, uint64_t size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "failed to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || offset > static_cast<uint64_t>(st.st_size)) {
+    std::cerr << path << " is not an mbm log\n";
+    close(fd);
+    return false;
+  }
+  if (size == 0)
+    size = st.st_size - offset;
+  if (size < sizeof(Header) || size > st.st_size - offset) {
+    std::cerr << path << " is not an mbm log\n";
+    close(fd);
+    return false;
+  }
+  // mmap offsets have to be page aligned.
+  uint64_t page_offset = offset % sysconf(_SC_PAGESIZE);
+  map_size_ = page_offset + size;
+  map_ = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd,
+              offset - page_offset);
+  close(fd);
+  if (map_ == MAP_FAILED) {
+    std::cerr << "failed to map " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  base_ = static_cast<const char*>(map_) + page_offset;
+  size_ = size;
+
+  const Header* header = reinterpret_cast<const Header*>(base_);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    std::cerr << path << " is not an mbm log\n";
+    return false;
+  }
+  if (header->version != kVersion || header->byte_order != kByteOrderMark) {
+    std::cerr << path << " was written by an incompatible version or on a "
+              << "machine with another byte order\n";
+    return false;
+  }
+  if (header->testdata_offset > size_ ||
+      header->testdata_size > size_ - header->testdata_offset ||
+      !MapColumns(header->server_records, &header->column_offsets[0],
+                  &server_) ||
+      !MapColumns(header->client_records, &header->column_offsets[3],
+                  &client_)) {
+    std::cerr << path << " is truncated\n";
+    return false;
+  }
+  testdata_ = base_ + header->testdata_offset;
+  testdata_size_ = header->testdata_size;
+  return true;
+}
+
+bool LogFile::MapColumns(uint64_t count, const uint64_t* offsets,
+                         ColumnView* columns) {
+  const uint64_t widths[3] = {sizeof(uint32_t), sizeof(uint32_t),
+                              sizeof(uint64_t)};
+  for (int i = 0; i < 3; ++i) {
+    if (offsets[i] % 8 != 0 || offsets[i] > size_ ||
+        count > (size_ - offsets[i]) / widths[i])
+      return false;
+  }
+  columns->size = count;
+  columns->seq_no = reinterpret_cast<const uint32_t*>(base_ + offsets[0]);
+  columns->nonce = reinterpret_cast<const uint32_t*>(base_ + offsets[1]);
+  columns->timestamp = reinterpret_cast<const uint64_t*>(base_ + offsets[2]);
+  return true;
+}
+
+}  // namespace mbm
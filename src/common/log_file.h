@@ -0,0 +1,100 @@
+#ifndef COMMON_LOG_FILE_H_
+#define COMMON_LOG_FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+namespace mbm {
+// A test's log in one binary file: a fixed header, the _testdata text, then
+// the server's and the client's records as columns of seq_no (32-bit), nonce
+// (32-bit) and timestamp (64-bit). Everything is in the writer's byte order
+// and every column starts on an 8-byte boundary, so a reader can mmap the
+// file and use the columns in place.
+
+const char kLogFileSuffix[] = "_log.mbm";
+
+// Where the logs of a test that ended at time go: the directory under the
+// log root, "/YYYY/MM/DD/", and the name the files start with,
+// "YYYYMMDDTHH:MM:SS.<ns>Z".
+std::string LogDirectory(const timespec& time);
+std::string LogName(const timespec& time);
+
+// Read-only view of one side's records, column by column.
+struct ColumnView {
+  size_t size;
+  const uint32_t* seq_no;
+  const uint32_t* nonce;
+  const uint64_t* timestamp;
+};
+
+// One side's records, column by column.
+struct RecordColumns {
+  void Append(uint32_t seq_no, uint32_t nonce, uint64_t timestamp);
+  void Reserve(size_t count);
+  size_t size() const { return seq_no.size(); }
+  ColumnView view() const;
+
+  std::vector<uint32_t> seq_no;
+  std::vector<uint32_t> nonce;
+  std::vector<uint64_t> timestamp;
+};
+
+// Writes a log at fd's current position with as few writev() calls as it
+// takes, padded to a multiple of 8 bytes so that another can follow it.
+// *size is the number of bytes written.
+bool WriteLog(int fd, const std::string& testdata,
+              const RecordColumns& server, const RecordColumns& client,
+              uint64_t* size);
+
+// Writes a log on its own to path.
+bool WriteLogFile(const std::string& path, const std::string& testdata,
+                  const RecordColumns& server, const RecordColumns& client);
+
+// Writes records in the text format of the old _serverdata and _clientdata
+// files: "seq_no nonce timestamp" per line.
+bool WriteTextRecords(const std::string& path, const ColumnView& records);
+
+// A log file mapped into memory. The accessors point into the mapping and
+// are valid until the LogFile goes away.
+class LogFile {
+  public:
+    LogFile();
+    ~LogFile();
+    // Maps path and checks the header. Returns false if it isn't a log this
+    // build can read.
+    bool Open(const std::string& path);
+    // Maps the log at offset in path, size bytes long; size 0 runs to the
+    // end of the file. offset must be a multiple of 8.
+    bool Open(const std::string& path, uint64_t offset, uint64_t size);
+
+    const char* testdata() const { return testdata_; }
+    size_t testdata_size() const { return testdata_size_; }
+
+    const ColumnView& server() const { return server_; }
+    const ColumnView& client() const { return client_; }
+
+  private:
+    bool MapColumns(uint64_t count, const uint64_t* offsets,
+                    ColumnView* columns);
+
+    void* map_;
+    size_t map_size_;
+    // The log within the mapping.
+    const char* base_;
+    uint64_t size_;
+    const char* testdata_;
+    size_t testdata_size_;
+    ColumnView server_;
+    ColumnView client_;
+
+    LogFile(const LogFile&);
+    LogFile& operator=(const LogFile&);
+};
+
+}  // namespace mbm
+
+#endif  // COMMON_LOG_FILE_H_
@@ -0,0 +1,60 @@
+#include "common/nonce.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common/time.h"
+
+namespace mbm {
+namespace {
+inline uint64_t Rotate(uint64_t x, int bits) {
+  return (x << bits) | (x >> (64 - bits));
+}
+
+inline void SipRound(uint64_t* v0, uint64_t* v1, uint64_t* v2,
+                     uint64_t* v3) {
+  *v0 += *v1; *v1 = Rotate(*v1, 13); *v1 ^= *v0; *v0 = Rotate(*v0, 32);
+  *v2 += *v3; *v3 = Rotate(*v3, 16); *v3 ^= *v2;
+  *v0 += *v3; *v3 = Rotate(*v3, 21); *v3 ^= *v0;
+  *v2 += *v1; *v1 = Rotate(*v1, 17); *v1 ^= *v2; *v2 = Rotate(*v2, 32);
+}
+}  // namespace
+
+uint64_t SipHash(uint64_t k0, uint64_t k1, uint64_t word) {
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  v3 ^= word;
+  SipRound(&v0, &v1, &v2, &v3);
+  SipRound(&v0, &v1, &v2, &v3);
+  v0 ^= word;
+  // The last block holds nothing but the message length, 8 bytes.
+  const uint64_t last = static_cast<uint64_t>(8) << 56;
+  v3 ^= last;
+  SipRound(&v0, &v1, &v2, &v3);
+  SipRound(&v0, &v1, &v2, &v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; ++i)
+    SipRound(&v0, &v1, &v2, &v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t RandomSeed() {
+  uint64_t seed = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd >= 0) {
+    ssize_t num_bytes = read(fd, &seed, sizeof(seed));
+    close(fd);
+    if (num_bytes == sizeof(seed))
+      return seed;
+  }
+  return GetTimeNS() ^ (static_cast<uint64_t>(getpid()) << 32);
+}
+
+uint64_t TestSeed(uint64_t secret) {
+  return SipHash(secret, 0, RandomSeed());
+}
+
+}  // namespace mbm
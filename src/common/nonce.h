@@ -0,0 +1,39 @@
+#ifndef COMMON_NONCE_H_
+#define COMMON_NONCE_H_
+
+#include <stdint.h>
+
+namespace mbm {
+
+// SipHash-2-4 of one 64-bit word, little endian, under the key (k0, k1).
+uint64_t SipHash(uint64_t k0, uint64_t k1, uint64_t word);
+
+// The nonce of every chunk of a test: SipHash of its seq_no, keyed with a
+// per-test seed. There is no shared state, so generators don't contend on
+// anything, and anyone who has the seed can produce the nonce of any chunk,
+// in any order. Without the seed, the nonces a client has seen tell it
+// nothing about the others, so it can't make up records for packets it never
+// received. The seed is logged, so that only holds while the test runs.
+class NonceSequence {
+  public:
+    explicit NonceSequence(uint64_t seed) : seed_(seed) {}
+
+    uint32_t nonce(uint32_t seq_no) const {
+      return static_cast<uint32_t>(SipHash(seed_, 0, seq_no));
+    }
+    uint64_t seed() const { return seed_; }
+
+  private:
+    uint64_t seed_;
+};
+
+// A seed from /dev/urandom, or the clock if that can't be read.
+uint64_t RandomSeed();
+// A new seed for a test: RandomSeed() hashed under secret, so that with a
+// secret configured the seed can't be guessed even when it came from the
+// clock.
+uint64_t TestSeed(uint64_t secret);
+
+}  // namespace mbm
+
+#endif  // COMMON_NONCE_H_
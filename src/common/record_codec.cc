@@ -0,0 +1,128 @@
+#include "common/record_codec.h"
+
+namespace mbm {
+namespace {
+// Varints are at most 10 bytes; with that much room left the decoder skips
+// the per-byte bounds checks.
+const size_t kMaxVarintBytes = 10;
+
+inline uint64_t ZigZag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^
+         static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+inline uint8_t* PutVarint(uint8_t* out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(value);
+  return out;
+}
+
+// Returns NULL if the varint runs past end or is too long.
+inline const uint8_t* GetVarint(const uint8_t* in, const uint8_t* end,
+                                uint64_t* value) {
+  uint64_t result = 0;
+  if (static_cast<size_t>(end - in) >= kMaxVarintBytes) {
+    for (unsigned shift = 0; shift < 7 * kMaxVarintBytes; shift += 7) {
+      uint8_t byte = *in++;
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        *value = result;
+        return in;
+      }
+    }
+    return NULL;
+  }
+  for (unsigned shift = 0; in < end && shift < 7 * kMaxVarintBytes;
+       shift += 7) {
+    uint8_t byte = *in++;
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *value = result;
+      return in;
+    }
+  }
+  return NULL;
+}
+}  // namespace
+
+RecordEncoder::RecordEncoder() : next_seq_no_(0), last_timestamp_(0) {
+}
+
+uint32_t RecordEncoder::Encode(const std::vector<TrafficData>& records,
+                               std::vector<uint8_t>* out) {
+  if (records.empty())
+    return kNonceChecksumSeed;
+
+  // Size for the worst case up front and trim afterwards, so that the loop
+  // only writes through a pointer.
+  size_t old_size = out->size();
+  out->resize(old_size + records.size() * kMaxEncodedRecordBytes);
+  uint8_t* const begin = &(*out)[0];
+  uint8_t* p = begin + old_size;
+
+  uint32_t checksum = kNonceChecksumSeed;
+  size_t i = 0;
+  while (i < records.size()) {
+    uint32_t first = records[i].seq_no();
+    size_t run = 1;
+    while (i + run < records.size() &&
+           records[i + run].seq_no() == first + run)
+      ++run;
+
+    p = PutVarint(p, ZigZag(static_cast<int32_t>(first - next_seq_no_)));
+    p = PutVarint(p, run);
+    for (size_t end = i + run; i < end; ++i) {
+      uint64_t timestamp = records[i].timestamp();
+      p = PutVarint(p, ZigZag(static_cast<int64_t>(timestamp -
+                                                   last_timestamp_)));
+      last_timestamp_ = timestamp;
+      checksum = UpdateNonceChecksum(checksum, records[i].nonce());
+    }
+    next_seq_no_ = first + run;
+  }
+  out->resize(p - begin);
+  return checksum;
+}
+
+RecordDecoder::RecordDecoder() : next_seq_no_(0), last_timestamp_(0) {
+}
+
+bool RecordDecoder::Decode(const uint8_t* data, size_t size,
+                           uint32_t num_records,
+                           std::vector<TrafficData>* records) {
+  const uint8_t* p = data;
+  const uint8_t* const end = data + size;
+  records->reserve(records->size() + num_records);
+
+  uint32_t decoded = 0;
+  while (decoded < num_records) {
+    uint64_t seq_delta;
+    uint64_t run;
+    if ((p = GetVarint(p, end, &seq_delta)) == NULL ||
+        (p = GetVarint(p, end, &run)) == NULL)
+      return false;
+    if (run == 0 || run > num_records - decoded)
+      return false;
+
+    uint32_t seq_no = next_seq_no_ + static_cast<uint32_t>(UnZigZag(seq_delta));
+    for (uint32_t j = 0; j < run; ++j) {
+      uint64_t timestamp_delta;
+      if ((p = GetVarint(p, end, &timestamp_delta)) == NULL)
+        return false;
+      last_timestamp_ += static_cast<uint64_t>(UnZigZag(timestamp_delta));
+      records->push_back(TrafficData(seq_no + j, 0, last_timestamp_));
+    }
+    next_seq_no_ = seq_no + run;
+    decoded += run;
+  }
+  return p == end;
+}
+
+}  // namespace mbm
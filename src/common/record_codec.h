@@ -0,0 +1,57 @@
+#ifndef COMMON_RECORD_CODEC_H_
+#define COMMON_RECORD_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "common/traffic_data.h"
+
+namespace mbm {
+// The compact encoding of receive records. Records are cut into runs of
+// consecutive sequence numbers; each run is the varint of its first sequence
+// number's distance from where the last run ended (zigzag, so reordering
+// costs little) and the varint of its length, followed by one zigzag varint
+// per record of its timestamp minus the one before. State carries over from
+// batch to batch, starting from sequence number 0 at time 0.
+//
+// Nonces aren't sent. Instead each batch carries a checksum of them, in
+// record order, which the server checks against the nonces it sent.
+
+// Worst case for one record: a run header of its own plus a timestamp delta.
+const size_t kMaxEncodedRecordBytes = 5 + 5 + 10;
+const uint32_t kNonceChecksumSeed = 2166136261u;
+
+inline uint32_t UpdateNonceChecksum(uint32_t checksum, uint32_t nonce) {
+  return (checksum ^ nonce) * 16777619u;
+}
+
+class RecordEncoder {
+  public:
+    RecordEncoder();
+    // Appends the encoding of records to out and returns their checksum.
+    uint32_t Encode(const std::vector<TrafficData>& records,
+                    std::vector<uint8_t>* out);
+
+  private:
+    uint32_t next_seq_no_;
+    uint64_t last_timestamp_;
+};
+
+class RecordDecoder {
+  public:
+    RecordDecoder();
+    // Appends num_records records decoded from data, with their nonces set
+    // to 0. Returns false unless data holds exactly that many.
+    bool Decode(const uint8_t* data, size_t size, uint32_t num_records,
+                std::vector<TrafficData>* records);
+
+  private:
+    uint32_t next_seq_no_;
+    uint64_t last_timestamp_;
+};
+
+}  // namespace mbm
+
+#endif  // COMMON_RECORD_CODEC_H_
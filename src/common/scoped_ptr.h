@@ -12,6 +12,11 @@ class scoped_ptr {
 
   const T* get() const { return ptr_; }
 
+  void reset(T* ptr) {
+    delete ptr_;
+    ptr_ = ptr;
+  }
+
  private:
   T* ptr_;
 };
@@ -0,0 +1,197 @@
+#include "common/segment_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+
+namespace mbm {
+namespace {
+const char kSegmentMagic[8] = {'M', 'B', 'M', 'S', 'E', 'G', '\0', '\0'};
+const char kIndexMagic[8] = {'M', 'B', 'M', 'I', 'D', 'X', '\0', '\0'};
+const uint32_t kVersion = 1;
+const uint32_t kByteOrderMark = 0x01020304;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+};
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t written = write(fd, p, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+int Create(const std::string& path, const char* magic) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  if (fd < 0) {
+    std::cerr << "failed to create " << path << ": " << strerror(errno)
+              << "\n";
+    return -1;
+  }
+  FileHeader header;
+  memcpy(header.magic, magic, sizeof(header.magic));
+  header.version = kVersion;
+  header.byte_order = kByteOrderMark;
+  if (!WriteAll(fd, &header, sizeof(header))) {
+    std::cerr << "failed to write " << path << ": " << strerror(errno)
+              << "\n";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+}  // namespace
+
+SegmentWriter::SegmentWriter()
+    : fd_(-1),
+      index_fd_(-1),
+      size_(0),
+      last_time_ns_(0) {
+}
+
+SegmentWriter::~SegmentWriter() {
+  Close();
+}
+
+bool SegmentWriter::Open(const std::string& path) {
+  Close();
+  fd_ = Create(path, kSegmentMagic);
+  if (fd_ < 0)
+    return false;
+  index_fd_ = Create(path + kSegmentIndexSuffix, kIndexMagic);
+  if (index_fd_ < 0) {
+    Close();
+    return false;
+  }
+  path_ = path;
+  size_ = sizeof(FileHeader);
+  last_time_ns_ = 0;
+  return true;
+}
+
+void SegmentWriter::Close() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (index_fd_ >= 0)
+    close(index_fd_);
+  fd_ = -1;
+  index_fd_ = -1;
+}
+
+bool SegmentWriter::Append(SegmentIndexEntry entry, const std::string& testdata,
+                           const RecordColumns& server,
+                           const RecordColumns& client, bool sync) {
+  // The log goes first, so an index entry never points at a partial one.
+  entry.offset = size_;
+  if (!WriteLog(fd_, testdata, server, client, &entry.size)) {
+    std::cerr << "failed to write " << path_ << ": " << strerror(errno)
+              << "\n";
+    // Whatever made it to the file is dead space; the next log starts after
+    // it so that it stays aligned.
+    off_t end = lseek(fd_, 0, SEEK_END);
+    if (end < 0 || (end % 8 != 0 && ftruncate(fd_, end + 8 - end % 8) != 0))
+      Close();
+    else
+      size_ = end + (8 - end % 8) % 8;
+    return false;
+  }
+  size_ += entry.size;
+
+  entry.time_ns = std::max(entry.time_ns, last_time_ns_);
+  last_time_ns_ = entry.time_ns;
+  if (!WriteAll(index_fd_, &entry, sizeof(entry))) {
+    std::cerr << "failed to write " << path_ << kSegmentIndexSuffix << ": "
+              << strerror(errno) << "\n";
+    // A partial entry would shift every entry after it; start over.
+    Close();
+    return false;
+  }
+  if (sync && (fsync(fd_) != 0 || fsync(index_fd_) != 0)) {
+    std::cerr << "failed to sync " << path_ << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+SegmentIndex::SegmentIndex()
+    : map_(MAP_FAILED),
+      map_size_(0),
+      entries_(NULL),
+      size_(0) {
+}
+
+SegmentIndex::~SegmentIndex() {
+  if (map_ != MAP_FAILED)
+    munmap(map_, map_size_);
+}
+
+bool SegmentIndex::Open(const std::string& segment_path) {
+  const std::string path = segment_path + kSegmentIndexSuffix;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "failed to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+    std::cerr << path << " is not a segment index\n";
+    close(fd);
+    return false;
+  }
+  map_size_ = st.st_size;
+  map_ = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map_ == MAP_FAILED) {
+    std::cerr << "failed to map " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+
+  const FileHeader* header = static_cast<const FileHeader*>(map_);
+  if (memcmp(header->magic, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+    std::cerr << path << " is not a segment index\n";
+    return false;
+  }
+  if (header->version != kVersion || header->byte_order != kByteOrderMark) {
+    std::cerr << path << " was written by an incompatible version or on a "
+              << "machine with another byte order\n";
+    return false;
+  }
+  entries_ = reinterpret_cast<const SegmentIndexEntry*>(header + 1);
+  size_ = (map_size_ - sizeof(FileHeader)) / sizeof(SegmentIndexEntry);
+  return true;
+}
+
+size_t SegmentIndex::LowerBound(uint64_t time_ns) const {
+  size_t first = 0;
+  size_t count = size_;
+  while (count > 0) {
+    size_t step = count / 2;
+    if (entries_[first + step].time_ns < time_ns) {
+      first += step + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return first;
+}
+
+}  // namespace mbm
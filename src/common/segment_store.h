@@ -0,0 +1,91 @@
+#ifndef COMMON_SEGMENT_STORE_H_
+#define COMMON_SEGMENT_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include "common/log_file.h"
+
+namespace mbm {
+// Tests logged back to back in large segment files rather than in a few
+// files each. A segment is a 16-byte header followed by test logs in the
+// format of log_file.h. Next to it, <segment>.idx is a 16-byte header and one
+// fixed size entry per test, in the order they were appended, which is time
+// order: a test can be found by time with a binary search, and a range of
+// tests read sequentially.
+
+const char kSegmentSuffix[] = ".mbs";
+const char kSegmentIndexSuffix[] = ".idx";
+
+struct SegmentIndexEntry {
+  // CLOCK_REALTIME when the test was logged. Never decreases within an
+  // index, even if the clock does.
+  uint64_t time_ns;
+  // Where the test's log is in the segment.
+  uint64_t offset;
+  uint64_t size;
+  // IPv6, or IPv4-mapped.
+  uint8_t client_addr[16];
+  uint32_t rate_kb_s;
+  uint32_t result;
+};
+
+// Appends tests to one segment and its index.
+class SegmentWriter {
+  public:
+    SegmentWriter();
+    ~SegmentWriter();
+
+    // Starts a new segment at path. Fails if it already exists.
+    bool Open(const std::string& path);
+    void Close();
+    bool is_open() const { return fd_ >= 0; }
+    uint64_t size() const { return size_; }
+
+    // Appends a test's log, then its index entry; entry.offset and
+    // entry.size are filled in here. With sync, both are on disk when it
+    // returns.
+    bool Append(SegmentIndexEntry entry, const std::string& testdata,
+                const RecordColumns& server, const RecordColumns& client,
+                bool sync);
+
+  private:
+    std::string path_;
+    int fd_;
+    int index_fd_;
+    uint64_t size_;
+    uint64_t last_time_ns_;
+
+    SegmentWriter(const SegmentWriter&);
+    SegmentWriter& operator=(const SegmentWriter&);
+};
+
+// A segment's index, mapped into memory.
+class SegmentIndex {
+  public:
+    SegmentIndex();
+    ~SegmentIndex();
+
+    // Maps the index of the segment at segment_path. An entry cut short by
+    // a crash is ignored.
+    bool Open(const std::string& segment_path);
+    size_t size() const { return size_; }
+    const SegmentIndexEntry& entry(size_t i) const { return entries_[i]; }
+    // The first test logged at or after time_ns, or size() if none was.
+    size_t LowerBound(uint64_t time_ns) const;
+
+  private:
+    void* map_;
+    size_t map_size_;
+    const SegmentIndexEntry* entries_;
+    size_t size_;
+
+    SegmentIndex(const SegmentIndex&);
+    SegmentIndex& operator=(const SegmentIndex&);
+};
+
+}  // namespace mbm
+
+#endif  // COMMON_SEGMENT_STORE_H_
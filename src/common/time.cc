@@ -2,7 +2,17 @@
 
 #include <time.h>
 #include <assert.h>
+#ifndef OS_FREEBSD
+#include <sys/prctl.h>
+#endif
+
+#if defined(ARCH_X86) && defined(__x86_64__)
+#define HAVE_TSC_CLOCK
+#include <cpuid.h>
+#endif
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <cerrno>
@@ -10,8 +20,248 @@
 #include "common/constants.h"
 
 namespace mbm {
+namespace {
+#ifdef HAVE_TSC_CLOCK
+// TSC clock readings are base_ns + ((tsc - base_tsc) * mult >> kTscShift).
+const int kTscShift = 32;
+const uint64_t kCalibrationNs = 20 * (NS_PER_SEC / MS_PER_SEC);
+const uint64_t kRecalibrationNs = NS_PER_SEC;
+// Each recalibration slews out the error it finds over the next interval,
+// but never by more than this, so the clock's rate stays within 500 ppm of
+// the measured TSC rate.
+const double kMaxSlew = 0.0005;
+// More than this and the TSC isn't to be trusted.
+const int64_t kMaxErrorNs = NS_PER_SEC / MS_PER_SEC;
+
+// The scale in use is published seqlock style: a calibration makes seq odd
+// while it changes the rest, and readers retry if seq changed under them.
+struct TscClock {
+  volatile uint32_t seq;
+  uint64_t base_tsc;
+  uint64_t base_ns;
+  uint64_t mult;
+  // When the next calibration is due.
+  uint64_t next_tsc;
+  // The first calibration point; the TSC rate is measured from there.
+  uint64_t origin_tsc;
+  uint64_t origin_ns;
+  double ns_per_cycle;
+  int64_t last_error_ns;
+  int64_t max_error_ns;
+};
+
+TscClock tsc_clock;
+volatile bool use_tsc = false;
+// Set when a calibration gave up on the TSC. Its errors are kept.
+volatile bool tsc_fell_back = false;
+// The last TSC clock reading before the fall back. The system clock may be
+// behind it, and time stands still there until it catches up.
+volatile uint64_t tsc_fall_back_ns = 0;
+
+inline void CompilerBarrier() {
+  __asm__ __volatile__("" ::: "memory");
+}
+
+inline uint64_t ScaleTsc(uint64_t tsc, uint64_t base_tsc, uint64_t base_ns,
+                         uint64_t mult) {
+  // A core a few cycles behind the calibrating one counts as no time at all.
+  if (tsc < base_tsc)
+    return base_ns;
+  return base_ns + static_cast<uint64_t>(
+      (static_cast<unsigned __int128>(tsc - base_tsc) * mult) >> kTscShift);
+}
+
+// The kernel only keeps its own clock on the TSC if it found it invariant
+// and in sync across CPUs.
+bool TscUsable() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+      (edx & (1 << 8)) == 0)
+    return false;
+  std::ifstream file(
+      "/sys/devices/system/clocksource/clocksource0/current_clocksource");
+  std::string current;
+  return (file >> current) && current == "tsc";
+}
+
+// A TSC reading and the system time at the same moment: the tightest of a
+// few tries at bracketing clock_gettime().
+void SampleClocks(uint64_t* tsc, uint64_t* ns) {
+  uint64_t best_width = 0;
+  for (int i = 0; i < 5; ++i) {
+    uint64_t before = __builtin_ia32_rdtsc();
+    uint64_t now = GetSystemTimeNS();
+    uint64_t after = __builtin_ia32_rdtsc();
+    if (i == 0 || after - before < best_width) {
+      best_width = after - before;
+      *tsc = before + best_width / 2;
+      *ns = now;
+    }
+  }
+}
+
+void SetTscScale(uint64_t tsc, uint64_t ns, double ns_per_cycle) {
+  tsc_clock.base_tsc = tsc;
+  tsc_clock.base_ns = ns;
+  tsc_clock.mult = static_cast<uint64_t>(ns_per_cycle * (1ULL << kTscShift));
+  tsc_clock.next_tsc =
+      tsc + static_cast<uint64_t>(kRecalibrationNs / tsc_clock.ns_per_cycle);
+}
+
+void RecordError(int64_t error_ns) {
+  tsc_clock.last_error_ns = error_ns;
+  int64_t abs_error_ns = error_ns < 0 ? -error_ns : error_ns;
+  if (abs_error_ns > tsc_clock.max_error_ns)
+    tsc_clock.max_error_ns = abs_error_ns;
+}
+
+// Called with seq odd.
+void RecalibrateTsc() {
+  uint64_t tsc, ns;
+  SampleClocks(&tsc, &ns);
+  uint64_t estimate_ns = ScaleTsc(tsc, tsc_clock.base_tsc, tsc_clock.base_ns,
+                                  tsc_clock.mult);
+  int64_t error_ns = static_cast<int64_t>(estimate_ns - ns);
+  RecordError(error_ns);
+  if (error_ns > kMaxErrorNs || error_ns < -kMaxErrorNs) {
+    std::cerr << "TSC clock is " << error_ns << " ns off, going back to the "
+              << "system clock\n";
+    tsc_fall_back_ns = ScaleTsc(__builtin_ia32_rdtsc(), tsc_clock.base_tsc,
+                                tsc_clock.base_ns, tsc_clock.mult);
+    __sync_synchronize();
+    tsc_fell_back = true;
+    use_tsc = false;
+    return;
+  }
+
+  tsc_clock.ns_per_cycle = static_cast<double>(ns - tsc_clock.origin_ns) /
+                           (tsc - tsc_clock.origin_tsc);
+  double slew = -static_cast<double>(error_ns) / kRecalibrationNs;
+  slew = std::max(-kMaxSlew, std::min(kMaxSlew, slew));
+  // Carry on from the current reading, so time doesn't step.
+  SetTscScale(tsc, estimate_ns, tsc_clock.ns_per_cycle * (1 + slew));
+}
+
+// The system clock, held back to where the TSC clock left off.
+uint64_t GetFallBackTimeNS() {
+  return std::max(GetSystemTimeNS(),
+                  static_cast<uint64_t>(tsc_fall_back_ns));
+}
+
+uint64_t GetTscTimeNS() {
+  while (true) {
+    uint32_t seq = tsc_clock.seq;
+    CompilerBarrier();
+    uint64_t base_tsc = tsc_clock.base_tsc;
+    uint64_t base_ns = tsc_clock.base_ns;
+    uint64_t mult = tsc_clock.mult;
+    uint64_t next_tsc = tsc_clock.next_tsc;
+    CompilerBarrier();
+    if ((seq & 1) != 0 || seq != tsc_clock.seq)
+      continue;
+
+    uint64_t tsc = __builtin_ia32_rdtsc();
+    if (tsc >= next_tsc &&
+        __sync_bool_compare_and_swap(&tsc_clock.seq, seq, seq + 1)) {
+      RecalibrateTsc();
+      __sync_synchronize();
+      tsc_clock.seq = seq + 2;
+      if (!use_tsc)
+        return GetFallBackTimeNS();
+      continue;
+    }
+    return ScaleTsc(tsc, base_tsc, base_ns, mult);
+  }
+}
+
+bool StartTsc() {
+  if (!TscUsable())
+    return false;
+  uint64_t tsc, ns;
+  SampleClocks(&tsc, &ns);
+  tsc_clock.origin_tsc = tsc;
+  tsc_clock.origin_ns = ns;
+  NanoSleepX(0, kCalibrationNs);
+  SampleClocks(&tsc, &ns);
+  if (tsc <= tsc_clock.origin_tsc)
+    return false;
+  tsc_clock.ns_per_cycle = static_cast<double>(ns - tsc_clock.origin_ns) /
+                           (tsc - tsc_clock.origin_tsc);
+  SetTscScale(tsc, ns, tsc_clock.ns_per_cycle);
+  tsc_clock.last_error_ns = 0;
+  tsc_clock.max_error_ns = 0;
+
+  // See how well that did over another short while.
+  NanoSleepX(0, kCalibrationNs);
+  SampleClocks(&tsc, &ns);
+  int64_t error_ns = static_cast<int64_t>(
+      ScaleTsc(tsc, tsc_clock.base_tsc, tsc_clock.base_ns, tsc_clock.mult) -
+      ns);
+  RecordError(error_ns);
+  return error_ns <= kMaxErrorNs && error_ns >= -kMaxErrorNs;
+}
+#endif  // HAVE_TSC_CLOCK
+}  // namespace
+
+bool ParseClockSource(const std::string& value, ClockSource* source) {
+  if (value == "system")
+    *source = CLOCK_SOURCE_SYSTEM;
+  else if (value == "tsc")
+    *source = CLOCK_SOURCE_TSC;
+  else
+    return false;
+  return true;
+}
+
+const char* ClockSourceName(ClockSource source) {
+  return source == CLOCK_SOURCE_TSC ? "tsc" : "system";
+}
+
+ClockSource SetClockSource(ClockSource source) {
+#ifdef HAVE_TSC_CLOCK
+  use_tsc = source == CLOCK_SOURCE_TSC && StartTsc();
+#endif
+  return GetClockSource();
+}
+
+ClockSource GetClockSource() {
+#ifdef HAVE_TSC_CLOCK
+  if (use_tsc)
+    return CLOCK_SOURCE_TSC;
+#endif
+  return CLOCK_SOURCE_SYSTEM;
+}
+
+void GetClockError(int64_t* last_ns, int64_t* max_ns) {
+  *last_ns = 0;
+  *max_ns = 0;
+#ifdef HAVE_TSC_CLOCK
+  if (use_tsc || tsc_fell_back) {
+    *last_ns = tsc_clock.last_error_ns;
+    *max_ns = tsc_clock.max_error_ns;
+  }
+#endif
+}
+
+bool ClockFellBack() {
+#ifdef HAVE_TSC_CLOCK
+  return tsc_fell_back;
+#else
+  return false;
+#endif
+}
 
 uint64_t GetTimeNS() {
+#ifdef HAVE_TSC_CLOCK
+  if (use_tsc)
+    return GetTscTimeNS();
+  if (tsc_fell_back)
+    return GetFallBackTimeNS();
+#endif
+  return GetSystemTimeNS();
+}
+
+uint64_t GetSystemTimeNS() {
   struct timespec time;
 #if defined(OS_FREEBSD)
   clock_gettime(CLOCK_MONOTONIC_PRECISE, &time);
@@ -31,4 +281,51 @@ void NanoSleepX(uint64_t sec, uint64_t ns) {
   }
 }
 
+Pacer::Pacer(uint64_t guard_ns)
+    : guard_ns_(guard_ns),
+      wakeup_late_ns_(0) {
+#ifndef OS_FREEBSD
+  // Timer slack defaults to 50us, which is most of the guard band. This only
+  // affects the calling thread.
+  if (guard_ns_ > 0)
+    prctl(PR_SET_TIMERSLACK, 1UL);
+#endif
+}
+
+void Pacer::SleepUntil(uint64_t deadline_ns) {
+  uint64_t guard_ns = 0;
+  if (guard_ns_ > 0)
+    guard_ns = guard_ns_ + 2 * wakeup_late_ns_;
+
+  uint64_t now = GetTimeNS();
+  if (deadline_ns > now + guard_ns) {
+    // The raw clock can't be slept on, so translate the wake time onto
+    // CLOCK_MONOTONIC. The two drift apart by ppm, which is nothing over a
+    // single sleep.
+    uint64_t wake_ns = deadline_ns - guard_ns;
+    struct timespec mono;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    uint64_t mono_wake_ns = static_cast<uint64_t>(mono.tv_sec) * NS_PER_SEC +
+                            mono.tv_nsec + (wake_ns - now);
+    struct timespec wake = {(__time_t)(mono_wake_ns / NS_PER_SEC),
+                            (long)(mono_wake_ns % NS_PER_SEC)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) ==
+           EINTR) {
+    }
+
+    now = GetTimeNS();
+    if (guard_ns_ > 0) {
+      uint64_t late_ns = now > wake_ns ? now - wake_ns : 0;
+      wakeup_late_ns_ = (7 * wakeup_late_ns_ + late_ns) / 8;
+    }
+  }
+
+  while (now < deadline_ns) {
+#ifdef ARCH_X86
+    __builtin_ia32_pause();
+#endif
+    now = GetTimeNS();
+  }
+}
+
 } // namespace mbm
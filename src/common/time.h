@@ -6,9 +6,54 @@
 #include <string>
 
 namespace mbm {
+enum ClockSource {
+  // clock_gettime() on the raw monotonic clock.
+  CLOCK_SOURCE_SYSTEM,
+  // The TSC, read directly and scaled to the raw monotonic clock. Calibrated
+  // when selected and then about once a second; drift between calibrations
+  // is slewed out rather than stepped, so it never goes backwards.
+  CLOCK_SOURCE_TSC
+};
+
+// Parses "system" or "tsc". Returns false for anything else.
+bool ParseClockSource(const std::string& value, ClockSource* source);
+const char* ClockSourceName(ClockSource source);
+// Selects what GetTimeNS() reads. Call it at startup, before there are other
+// threads. The TSC is only used if it's invariant and the kernel keeps its
+// own clock on it; returns the source actually selected. If a calibration
+// ever finds the TSC more than a millisecond off, GetTimeNS() goes back to
+// the system clock for good. That can step forward, but never back: if the
+// system clock is behind, GetTimeNS() holds at the last TSC reading until it
+// catches up.
+ClockSource SetClockSource(ClockSource source);
+ClockSource GetClockSource();
+// How far the TSC clock was from the system clock at the last calibration,
+// and the largest distance seen, in ns. Both 0 if the TSC was never used;
+// after a fall back they're what made it happen.
+void GetClockError(int64_t* last_ns, int64_t* max_ns);
+// Whether the TSC clock was given up on for being too far off.
+bool ClockFellBack();
+
 uint64_t GetTimeNS();
+// Always the system clock, whatever the source.
+uint64_t GetSystemTimeNS();
 void NanoSleepX(uint64_t sec, uint64_t ns);
 
+// Waits for absolute GetTimeNS() deadlines. Sleeps on an absolute timer until
+// guard_ns before the deadline, then spins on GetTimeNS() for the rest, so
+// wakeup latency and timer slack don't show up as pacing jitter. The guard
+// grows with the wakeup latency actually observed. A guard of 0 never spins.
+class Pacer {
+  public:
+    explicit Pacer(uint64_t guard_ns);
+    void SleepUntil(uint64_t deadline_ns);
+
+  private:
+    uint64_t guard_ns_;
+    // Running average of how late the timer woke us, in ns.
+    uint64_t wakeup_late_ns_;
+};
+
 }  // namespace mbm
 
 #endif  // COMMON_TIME_H_
@@ -0,0 +1,243 @@
+#include "common/timestamping.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#ifndef OS_FREEBSD
+#include <linux/errqueue.h>
+#include <linux/ethtool.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
+
+#include <iostream>
+#include <sstream>
+
+#include "common/constants.h"
+#include "common/time.h"
+
+namespace mbm {
+namespace {
+bool SameAddress(const sockaddr* a, const sockaddr_storage& b) {
+  if (a->sa_family != b.ss_family)
+    return false;
+  if (a->sa_family == AF_INET) {
+    return memcmp(&reinterpret_cast<const sockaddr_in*>(a)->sin_addr,
+                  &reinterpret_cast<const sockaddr_in*>(&b)->sin_addr,
+                  sizeof(in_addr)) == 0;
+  }
+  if (a->sa_family == AF_INET6) {
+    return memcmp(&reinterpret_cast<const sockaddr_in6*>(a)->sin6_addr,
+                  &reinterpret_cast<const sockaddr_in6*>(&b)->sin6_addr,
+                  sizeof(in6_addr)) == 0;
+  }
+  return false;
+}
+
+#if defined(SO_TIMESTAMPING) && !defined(OS_FREEBSD)
+// Finds the device fd's local address is on. Returns false if there is none.
+bool LocalDevice(int fd, std::string* name) {
+  sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&local), &local_len) != 0)
+    return false;
+  ifaddrs* addrs;
+  if (getifaddrs(&addrs) != 0)
+    return false;
+
+  bool found = false;
+  for (ifaddrs* addr = addrs; addr != NULL && !found; addr = addr->ifa_next) {
+    if (addr->ifa_addr == NULL || !SameAddress(addr->ifa_addr, local))
+      continue;
+    *name = addr->ifa_name;
+    found = true;
+  }
+  freeifaddrs(addrs);
+  return found;
+}
+
+// Makes sure the device stamps every packet sent, or every one received, in
+// hardware, turning that on if it isn't already. Whatever else the device
+// stamps for other users, such as ptp4l, is kept.
+bool EnableDeviceTimestamping(int fd, const std::string& device, bool tx) {
+  hwtstamp_config config;
+  memset(&config, 0, sizeof(config));
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, device.c_str(), IFNAMSIZ - 1);
+  request.ifr_data = reinterpret_cast<char*>(&config);
+#ifdef SIOCGHWTSTAMP
+  // Devices that can't report their settings are simply set.
+  if (ioctl(fd, SIOCGHWTSTAMP, &request) == 0 &&
+      (tx ? config.tx_type == HWTSTAMP_TX_ON
+          : config.rx_filter == HWTSTAMP_FILTER_ALL))
+    return true;
+#endif
+  if (tx)
+    config.tx_type = HWTSTAMP_TX_ON;
+  else
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+  // The device writes back what it actually did.
+  if (ioctl(fd, SIOCSHWTSTAMP, &request) != 0) {
+    std::cerr << "Failed to turn on hardware timestamps on " << device << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  if (tx ? config.tx_type != HWTSTAMP_TX_ON
+         : config.rx_filter != HWTSTAMP_FILTER_ALL) {
+    std::cerr << device << " can't timestamp every "
+              << (tx ? "sent" : "received") << " packet in hardware"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+#endif
+}  // namespace
+
+bool ParseTimestampingMode(const std::string& value, TimestampingMode* mode) {
+  if (value == "none")
+    *mode = TIMESTAMPING_NONE;
+  else if (value == "software")
+    *mode = TIMESTAMPING_SOFTWARE;
+  else if (value == "hardware")
+    *mode = TIMESTAMPING_HARDWARE;
+  else
+    return false;
+  return true;
+}
+
+bool EnableTimestamping(int fd, TimestampingMode mode, bool tx) {
+#if defined(SO_TIMESTAMPING) && !defined(OS_FREEBSD)
+  if (mode == TIMESTAMPING_NONE)
+    return false;
+
+  int flags = SOF_TIMESTAMPING_SOFTWARE;
+  if (tx) {
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+             SOF_TIMESTAMPING_OPT_TSONLY;
+  } else {
+    flags |= SOF_TIMESTAMPING_RX_SOFTWARE;
+  }
+  if (mode == TIMESTAMPING_HARDWARE) {
+    // The socket flags only ask for the stamps; the device has to be told to
+    // take them.
+    std::string device;
+    if (!LocalDevice(fd, &device)) {
+      std::cerr << "No device to timestamp in hardware on" << std::endl;
+      return false;
+    }
+    if (!EnableDeviceTimestamping(fd, device, tx))
+      return false;
+    flags |= SOF_TIMESTAMPING_RAW_HARDWARE |
+             (tx ? SOF_TIMESTAMPING_TX_HARDWARE
+                 : SOF_TIMESTAMPING_RX_HARDWARE);
+  }
+
+  // Clearing first restarts the OPT_ID count if it was already on.
+  int off = 0;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &off, sizeof(off));
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0) {
+    std::cout << "Socket does not support SO_TIMESTAMPING: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t TimestampingControlBytes() {
+#if defined(SO_TIMESTAMPING) && !defined(OS_FREEBSD)
+  return CMSG_SPACE(sizeof(scm_timestamping)) +
+         CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6));
+#else
+  return 0;
+#endif
+}
+
+int OpenHardwareClock(int fd) {
+#if defined(SO_TIMESTAMPING) && !defined(OS_FREEBSD)
+  std::string device;
+  if (!LocalDevice(fd, &device))
+    return -1;
+  ethtool_ts_info info;
+  memset(&info, 0, sizeof(info));
+  info.cmd = ETHTOOL_GET_TS_INFO;
+  ifreq request;
+  memset(&request, 0, sizeof(request));
+  strncpy(request.ifr_name, device.c_str(), IFNAMSIZ - 1);
+  request.ifr_data = reinterpret_cast<char*>(&info);
+  if (ioctl(fd, SIOCETHTOOL, &request) != 0 || info.phc_index < 0)
+    return -1;
+  std::ostringstream path;
+  path << "/dev/ptp" << info.phc_index;
+  return open(path.str().c_str(), O_RDONLY);
+#else
+  return -1;
+#endif
+}
+
+uint64_t GetTimestamp(msghdr* msg, int64_t realtime_offset_ns,
+                      const int64_t* hardware_offset_ns, bool* hardware_used) {
+  if (hardware_used != NULL)
+    *hardware_used = false;
+#if defined(SO_TIMESTAMPING) && !defined(OS_FREEBSD)
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+      continue;
+    scm_timestamping stamps;
+    memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+    // ts[0] is software, ts[2] raw hardware.
+    const timespec& hardware = stamps.ts[2];
+    if (hardware_offset_ns != NULL &&
+        (hardware.tv_sec != 0 || hardware.tv_nsec != 0)) {
+      if (hardware_used != NULL)
+        *hardware_used = true;
+      return static_cast<uint64_t>(hardware.tv_sec) * NS_PER_SEC +
+             hardware.tv_nsec + *hardware_offset_ns;
+    }
+    const timespec& software = stamps.ts[0];
+    if (software.tv_sec == 0 && software.tv_nsec == 0)
+      return 0;
+    return static_cast<uint64_t>(software.tv_sec) * NS_PER_SEC +
+           software.tv_nsec + realtime_offset_ns;
+  }
+#endif
+  return 0;
+}
+
+int64_t GetRealtimeOffsetNS() {
+  struct timespec realtime;
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  uint64_t now = GetTimeNS();
+  return static_cast<int64_t>(now) -
+         static_cast<int64_t>(static_cast<uint64_t>(realtime.tv_sec) *
+                              NS_PER_SEC + realtime.tv_nsec);
+}
+
+bool GetHardwareOffsetNS(int clock_fd, int64_t* offset_ns) {
+  // The dynamic POSIX clock of a descriptor, FD_TO_CLOCKID in the kernel.
+  const clockid_t clock = (~static_cast<clockid_t>(clock_fd) << 3) | 3;
+  // Splitting the difference of two reads halves the error the device read
+  // adds.
+  uint64_t before = GetTimeNS();
+  struct timespec device;
+  if (clock_gettime(clock, &device) != 0)
+    return false;
+  uint64_t after = GetTimeNS();
+  *offset_ns = static_cast<int64_t>(before + (after - before) / 2) -
+               static_cast<int64_t>(static_cast<uint64_t>(device.tv_sec) *
+                                    NS_PER_SEC + device.tv_nsec);
+  return true;
+}
+
+}  // namespace mbm
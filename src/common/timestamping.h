@@ -0,0 +1,56 @@
+#ifndef COMMON_TIMESTAMPING_H_
+#define COMMON_TIMESTAMPING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <string>
+
+namespace mbm {
+enum TimestampingMode {
+  TIMESTAMPING_NONE,
+  TIMESTAMPING_SOFTWARE,
+  // Software timestamps are still asked for, and used whenever the device
+  // doesn't stamp a packet.
+  TIMESTAMPING_HARDWARE
+};
+
+// Parses "none", "software" or "hardware". Returns false for anything else.
+bool ParseTimestampingMode(const std::string& value, TimestampingMode* mode);
+
+// Turns on SO_TIMESTAMPING for received packets, or for sent ones. Sent
+// packets are reported on the error queue, numbered from 0 from this call on
+// (packets for UDP, bytes for TCP), without their payload. In hardware mode
+// the device fd's local address is on is also set to stamp every packet
+// (SIOCSHWTSTAMP, which needs CAP_NET_ADMIN unless it already does); if it
+// can't be, this fails rather than settling for software stamps.
+bool EnableTimestamping(int fd, TimestampingMode mode, bool tx);
+
+// Room for the control messages of one timestamped packet, error queue
+// included.
+size_t TimestampingControlBytes();
+
+// Opens the clock of the device fd's local address is on, which is what its
+// hardware timestamps are taken on. Returns -1 if there is no such clock or
+// the device can't be told from the address; close the descriptor when done.
+int OpenHardwareClock(int fd);
+
+// Returns the kernel timestamp carried by msg in GetTimeNS() time, or 0 if
+// there is none. Software timestamps are CLOCK_REALTIME, and
+// realtime_offset_ns is GetTimeNS() minus CLOCK_REALTIME. Hardware ones are on
+// the device's clock and are only used given hardware_offset_ns, GetTimeNS()
+// minus that clock; otherwise, or when the device didn't stamp the packet, the
+// software timestamp is returned. hardware_used, if given, says which.
+uint64_t GetTimestamp(msghdr* msg, int64_t realtime_offset_ns,
+                      const int64_t* hardware_offset_ns,
+                      bool* hardware_used);
+
+// GetTimeNS() minus CLOCK_REALTIME right now.
+int64_t GetRealtimeOffsetNS();
+// GetTimeNS() minus the clock from OpenHardwareClock() right now. Returns
+// false if the clock can't be read.
+bool GetHardwareOffsetNS(int clock_fd, int64_t* offset_ns);
+
+}  // namespace mbm
+
+#endif  // COMMON_TIMESTAMPING_H_
@@ -23,6 +23,21 @@ TrafficData TrafficData::hton(const TrafficData& data) {
            htonl(data.sec_), htonl(data.rem_));
 }
 
+// static
+void TrafficData::ntoh(TrafficData* data, size_t count) {
+  // Every field is 32 bits, so the records are one flat run of words. A
+  // plain loop over them vectorizes.
+  uint32_t* words = reinterpret_cast<uint32_t*>(data);
+  const size_t num_words = count * (sizeof(TrafficData) / sizeof(uint32_t));
+  for (size_t i = 0; i < num_words; ++i)
+    words[i] = ntohl(words[i]);
+}
+
+// static
+void TrafficData::hton(TrafficData* data, size_t count) {
+  ntoh(data, count);
+}
+
 TrafficData::TrafficData()
   : seq_no_(0), nonce_(0), sec_(0), rem_(0) {
 }
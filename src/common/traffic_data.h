@@ -1,6 +1,7 @@
 #ifndef COMMON_TRAFFIC_DATA_H_
 #define COMMON_TRAFFIC_DATA_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace mbm {
@@ -8,6 +9,9 @@ class TrafficData {
   public:
     static TrafficData ntoh(const TrafficData &data);
     static TrafficData hton(const TrafficData &data);
+    // Convert count records in place.
+    static void ntoh(TrafficData* data, size_t count);
+    static void hton(TrafficData* data, size_t count);
     TrafficData(uint32_t seq_no, uint32_t nonce, uint64_t timestamp);
     TrafficData();
     uint32_t seq_no() const { return seq_no_; };
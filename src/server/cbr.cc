@@ -11,43 +11,113 @@
 #include <string.h>
 #include <math.h>
 #include <signal.h>
+#include <stdio.h>
 #include <time.h>
 
 #include <iostream>
 #include <sstream>
-#include <fstream>
 #include <iomanip>
-#include <boost/filesystem.hpp>
 
 #include "common/config.h"
 #include "common/constants.h"
+#include "common/log_file.h"
 #include "common/scoped_ptr.h"
 #include "common/time.h"
 #include "common/traffic_data.h"
+#include "server/log_writer.h"
+#include "server/record_reader.h"
+#include "server/tcp_stats.h"
 #include "server/traffic_generator.h"
 #include "server/stat_test.h"
 #include "gflags/gflags.h"
 #include "mlab/socket.h"
 #include "mlab/accepted_socket.h"
 #include "server/model.h"
-#ifdef USE_WEB100
-#include "server/web100.h"
-#endif
 
 DECLARE_bool(verbose);
-DEFINE_string(prefix, ".", "The root of the log directory");
+DEFINE_string(pacing, "user", "Pacing engine for the test traffic: 'user' "
+                              "sleeps between bursts, 'kernel' hands "
+                              "departure times to the kernel (needs fq)");
+DEFINE_int32(kernel_pacing_lead_ms, 10, "How far ahead of the schedule "
+                                        "traffic is queued with "
+                                        "--pacing=kernel");
+DEFINE_int32(kernel_pacing_queue_pkt, 90, "The most UDP packets queued ahead "
+                                          "of the schedule with "
+                                          "--pacing=kernel. Keep it under "
+                                          "fq's flow_limit, 100 by default");
+DEFINE_int32(record_poll_ms, 100, "How often to read the receive records a "
+                                  "streaming client sends during the test");
+DEFINE_int32(reorder_window_ms, 300, "How long a streaming client's record "
+                                     "of a packet may trail the records of "
+                                     "later packets before the packet counts "
+                                     "as lost while the test runs");
+DEFINE_string(tcp_stats, "auto", "Where TCP tests get their loss and queue "
+                                "statistics: 'web100', 'tcp_info', 'auto' "
+                                "for web100 when available and tcp_info "
+                                "otherwise, or 'none'");
+DEFINE_int32(sprt_interval_ms, 0, "How often TCP tests run the statistical "
+                                  "test. 0 runs it once per target rtt");
+DEFINE_int32(pacer_guard_us, 50, "With --pacing=user, spin for this long "
+                                 "before each burst instead of trusting the "
+                                 "timer. 0 only sleeps.");
 
 namespace {
-bool ValidatePrefix(const char* flagname, const std::string& value) {
-  boost::system::error_code ec;
-  if (boost::filesystem::is_directory(value, ec)) {
+bool ValidatePacing(const char* flagname, const std::string& value) {
+  if (value == "user" || value == "kernel")
     return true;
-  } else {
-    std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
-    return false;
-  }
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
+}
+
+bool ValidateLead(const char* flagname, int32_t value) {
+  if (value >= 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
+}
+
+bool ValidateNonNegative(const char* flagname, int32_t value) {
+  if (value >= 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
 }
 
+bool ValidatePositive(const char* flagname, int32_t value) {
+  if (value > 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
+}
+
+bool ValidateTcpStats(const char* flagname, const std::string& value) {
+  mbm::TcpStatsSource source;
+  if (mbm::ParseTcpStatsSource(value, &source))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
+}
+
+const bool pacing_validator =
+    gflags::RegisterFlagValidator(&FLAGS_pacing, &ValidatePacing);
+const bool lead_validator =
+    gflags::RegisterFlagValidator(&FLAGS_kernel_pacing_lead_ms, &ValidateLead);
+const bool queue_validator =
+    gflags::RegisterFlagValidator(&FLAGS_kernel_pacing_queue_pkt,
+                                  &ValidatePositive);
+const bool guard_validator =
+    gflags::RegisterFlagValidator(&FLAGS_pacer_guard_us, &ValidateNonNegative);
+const bool sprt_interval_validator =
+    gflags::RegisterFlagValidator(&FLAGS_sprt_interval_ms,
+                                  &ValidateNonNegative);
+const bool record_poll_validator =
+    gflags::RegisterFlagValidator(&FLAGS_record_poll_ms, &ValidatePositive);
+const bool reorder_window_validator =
+    gflags::RegisterFlagValidator(&FLAGS_reorder_window_ms,
+                                  &ValidateNonNegative);
+const bool tcp_stats_validator =
+    gflags::RegisterFlagValidator(&FLAGS_tcp_stats, &ValidateTcpStats);
+
 } // namespace
 
 namespace mbm {
@@ -79,9 +149,31 @@ int addr_to_string(sockaddr_storage* addr, char* dst, socklen_t size) {
   return 0;
 }
 
+void addr_to_bytes(const sockaddr_storage* addr, uint8_t* dst) {
+  // IPv4 is stored IPv4-mapped: ::ffff:a.b.c.d
+  memset(dst, 0, 16);
+  switch (addr->ss_family) {
+    case AF_INET: {
+        const sockaddr_in* addr_in =
+            reinterpret_cast<const sockaddr_in*>(addr);
+        dst[10] = 0xff;
+        dst[11] = 0xff;
+        memcpy(dst + 12, &addr_in->sin_addr, 4);
+      }
+      break;
+    case AF_INET6: {
+        const sockaddr_in6* addr_in =
+            reinterpret_cast<const sockaddr_in6*>(addr);
+        memcpy(dst, &addr_in->sin6_addr, 16);
+      }
+      break;
+  }
+}
+
 Result RunCBR(const mlab::AcceptedSocket* test_socket,
               const mlab::AcceptedSocket* ctrl_socket,
-              const Config& config) {
+              const Config& config,
+              LogWriter* log_writer) {
 
   std::cout.setf(std::ios_base::fixed);
   std::cout.precision(3);
@@ -166,10 +258,14 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
   // calculate how many sec per chunk
   double time_per_chunk_sec = 1.0 / chunks_per_sec;
 
-  // calculate the burst size for sleep time to be greater than 500us
+  // calculate the burst size for the time between bursts to be long enough
+  // to sleep through: the spinning pacer copes with much shorter gaps.
   // if the burst size from config is greater, use the config burst size
-  uint32_t burst_size_pkt = std::max(1000000 / time_per_chunk_ns,
+  uint64_t min_burst_ns = FLAGS_pacer_guard_us > 0 ? MIN_BURST_SPIN_NS
+                                                   : MIN_BURST_NS;
+  uint32_t burst_size_pkt = std::max(min_burst_ns / time_per_chunk_ns,
                                      static_cast<uint64_t>(config.burst_size));
+  burst_size_pkt = std::max(burst_size_pkt, 1u);
 
   // calculate the maximum test time
   uint32_t max_test_time_sec =
@@ -230,24 +326,34 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
   std::cout << "  test traffic should take at most "
             << max_test_time_sec << " seconds\n";
 
-  // Initialize the web100 agent
-  #ifdef USE_WEB100
-  web100::Agent agent;
-  #endif // USE_WEB100
-
-  #ifdef USE_WEB100
-  TrafficGenerator growth_generator(test_socket, bytes_per_chunk, max_cwnd_pkt);
-  uint64_t growth_start_time = GetTimeNS();
+  // TCP statistics drive the cwnd growth phase and the statistical test of
+  // TCP tests. UDP tests get theirs from the client's records.
+  TcpStatsSource tcp_stats_source = TCP_STATS_NONE;
+  ParseTcpStatsSource(FLAGS_tcp_stats, &tcp_stats_source);
+  TcpStats test_stats(test_socket, tcp_stats_source);
+  const bool have_tcp_stats = test_stats.source() != TCP_STATS_NONE;
   if (test_socket->type() == SOCKETTYPE_TCP) {
-    web100::Connection growth_connection(test_socket, agent.get());
-    growth_connection.Start();
-    while (growth_generator.packets_sent() < max_cwnd_pkt) {
-      growth_connection.Stop();
-      if (growth_connection.CurCwnd() >= target_pipe_size_bytes) {
+    std::cout << "  tcp stats: " << TcpStatsSourceName(test_stats.source())
+              << "\n";
+  }
+
+  // Growth and test traffic come from the same generator, so seq_nos carry
+  // on from one phase to the next.
+  TrafficGenerator generator(test_socket, bytes_per_chunk,
+                             max_cwnd_pkt + max_test_pkt);
+  if (have_tcp_stats && max_cwnd_pkt > 0) {
+    const uint64_t target_pipe_size_bytes = target_pipe_size * bytes_per_chunk;
+    const uint64_t rtt_ns = static_cast<uint64_t>(config.rtt_ms) * 1000000;
+    uint64_t growth_start_time = GetTimeNS();
+    TcpStats growth_stats(test_socket, test_stats.source());
+    growth_stats.Start();
+    while (generator.packets_sent() < max_cwnd_pkt) {
+      growth_stats.Stop();
+      if (growth_stats.CurCwnd() >= target_pipe_size_bytes) {
         std::cout << "cwnd reached" << std::endl;
         break;
       }
-      if (!growth_generator.Send(target_pipe_size)) {
+      if (!generator.Send(target_pipe_size)) {
         return RESULT_ERROR;
       }
       if (GetTimeNS() > growth_start_time
@@ -258,29 +364,72 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
       NanoSleepX( rtt_ns / NS_PER_SEC, rtt_ns % NS_PER_SEC);
     }
     std::cout << "loss during growth: "
-              << growth_connection.PacketRetransCount() << std::endl;
+              << growth_stats.PacketRetransCount() << std::endl;
     std::cout << "growing phase done" << std::endl;
 
-    // uint32_t growth_rtt = growth_connection.SampleRTT();
-    while (growth_connection.SndNxt() - growth_connection.SndUna()
-            >= std::max(target_pipe_size_bytes / 2, static_cast<uint64_t>(1))) {
-      growth_connection.Stop();
-      // NanoSleepX(growth_rtt / MS_PER_SEC, (growth_rtt % MS_PER_SEC) * 1000000);
-    }
-    std::cout << "done draining" << std::endl;
+    const uint32_t drained_bytes = static_cast<uint32_t>(
+        std::max(target_pipe_size_bytes / 2, static_cast<uint64_t>(1)));
+    const uint64_t drain_deadline =
+        GetTimeNS() + static_cast<uint64_t>(DEFAULT_TIMEO_SEC) * NS_PER_SEC;
+    if (growth_stats.WaitForDrain(drained_bytes, drain_deadline))
+      std::cout << "done draining" << std::endl;
+    else
+      std::cout << "queue still full, starting anyway" << std::endl;
   }
-  #endif
+  const uint32_t growth_pkt = generator.packets_sent();
+  const uint64_t growth_bytes = generator.total_bytes_sent();
 
   // Start the test
   StatTest tester(target_run_length);
-  TrafficGenerator generator(test_socket, bytes_per_chunk, max_test_pkt);
-
-  #ifdef USE_WEB100
-  web100::Connection test_connection(test_socket, agent.get());
-  if (test_socket->type() == SOCKETTYPE_TCP) {
-    test_connection.Start();
+  test_stats.Start();
+
+  // With kernel pacing the departure times travel with the traffic, so we
+  // fill the queue up to lead_ns ahead of the schedule and only wake up once
+  // half of it has drained.
+  bool kernel_paced = false;
+  if (FLAGS_pacing == "kernel") {
+    kernel_paced = generator.EnableKernelPacing(bytes_per_sec,
+                                                time_per_chunk_ns);
+    if (!kernel_paced)
+      std::cout << "kernel pacing not available, pacing in user space\n";
+  }
+  const char* pacing_engine = kernel_paced ? "kernel" : "user";
+  uint64_t lead_ns = kernel_paced ?
+      static_cast<uint64_t>(FLAGS_kernel_pacing_lead_ms) * 1000000 : 0;
+  if (kernel_paced && test_socket->type() == SOCKETTYPE_UDP) {
+    // fq drops a flow's datagrams beyond its flow_limit, and the send buffer
+    // has to hold everything queued too; a datagram is charged about twice
+    // its size there. The queue peaks at the lead plus one burst.
+    uint32_t queue_pkt = FLAGS_kernel_pacing_queue_pkt;
+    int sndbuf = 0;
+    socklen_t sndbuf_len = sizeof(sndbuf);
+    if (getsockopt(test_socket->raw(), SOL_SOCKET, SO_SNDBUF, &sndbuf,
+                   &sndbuf_len) == 0 && sndbuf > 0) {
+      queue_pkt = std::min(queue_pkt, std::max(
+          static_cast<uint32_t>(sndbuf) / (2 * bytes_per_chunk), 1u));
+    }
+    burst_size_pkt = std::min(burst_size_pkt, std::max(queue_pkt / 2, 1u));
+    lead_ns = std::min(lead_ns, static_cast<uint64_t>(
+        queue_pkt - burst_size_pkt) * time_per_chunk_ns);
+    std::cout << "  kernel pacing queue: " << queue_pkt << " packets, lead "
+              << lead_ns << " ns, burst " << burst_size_pkt << "\n";
   }
-  #endif
+  std::cout << "  pacing: " << pacing_engine << "\n";
+  Pacer pacer(kernel_paced ? 0 :
+              static_cast<uint64_t>(FLAGS_pacer_guard_us) * 1000);
+
+  // A streaming client sends its receive records while the test runs; they
+  // are picked up every record_poll_ns so the upload doesn't pile up at END.
+  const bool streaming = (config.features & FEATURE_STREAM_RECORDS) != 0;
+  // Packets get at least one poll interval, however short the window.
+  const uint32_t settle_polls =
+      (FLAGS_reorder_window_ms + FLAGS_record_poll_ms - 1) /
+      FLAGS_record_poll_ms;
+  RecordReader client_records(ctrl_socket->raw(), config.features,
+                              max_test_pkt + max_cwnd_pkt, settle_polls);
+  const uint64_t record_poll_ns =
+      static_cast<uint64_t>(FLAGS_record_poll_ms) * 1000000;
+  uint64_t next_record_poll = GetTimeNS() + record_poll_ns;
 
   Result test_result = RESULT_INCONCLUSIVE;
   bool result_set = false;
@@ -289,45 +438,75 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
   uint64_t missed_max = 0;
   uint32_t missed_sleep = 0;
 
-  while (generator.packets_sent() < max_test_pkt) {
+  // TCP tests run the statistical test on a deadline, once per target rtt by
+  // default, on one snapshot of the TCP statistics. UDP tests run it
+  // whenever new receive records have been read.
+  uint64_t sprt_interval_ns =
+      static_cast<uint64_t>(FLAGS_sprt_interval_ms != 0 ? FLAGS_sprt_interval_ms
+                                                        : config.rtt_ms) *
+      1000000;
+  sprt_interval_ns = std::max(sprt_interval_ns,
+                              static_cast<uint64_t>(NS_PER_SEC / MS_PER_SEC));
+  uint64_t next_sprt = outer_start_time + sprt_interval_ns;
+  uint32_t sprt_evaluations = 0;
+  uint64_t sprt_decision_ns = 0;
+
+  uint32_t test_pkt = 0;
+  while (test_pkt < max_test_pkt) {
     if (!generator.Send(burst_size_pkt)) {
       return RESULT_ERROR;
     }
+    test_pkt = generator.packets_sent() - growth_pkt;
 
-    #ifdef USE_WEB100
-    if (test_socket->type() == SOCKETTYPE_TCP) {
-      // sample the data once a second
-      if (generator.packets_sent() % chunks_per_sec == 0) {
-        // statistical test
-        test_connection.Stop();
-        uint32_t loss = test_connection.PacketRetransCount();
-        uint32_t n = generator.packets_sent();
-        test_result = tester.test_result(n, loss);
-        if (test_result == RESULT_PASS) {
-          std::cout << "passed SPRT" << std::endl;
-          result_set = true;
-          break;
-        } else if (test_result == RESULT_FAIL) {
-          std::cout << "failed SPRT" << std::endl;
-          result_set = true;
-          break;
-        }
-      }
-    }
-    #endif
-    
     // figure out the start time for the next chunk
-    uint64_t next_start = outer_start_time +
-                          generator.packets_sent() * time_per_chunk_ns;
+    uint64_t next_start = outer_start_time + test_pkt * time_per_chunk_ns;
     uint64_t curr_time = GetTimeNS();
-    int32_t left_over_ns = next_start - curr_time;
-    if (left_over_ns > 0) {
-      // If we have time left over, sleep the remainder.
-      NanoSleepX(left_over_ns / NS_PER_SEC, left_over_ns % NS_PER_SEC);
-    } else {
-      missed_total += abs(left_over_ns);
+
+    bool evaluate = false;
+    uint32_t n = 0;
+    uint32_t loss = 0;
+    if (streaming && curr_time >= next_record_poll) {
+      if (!client_records.Poll())
+        return RESULT_ERROR;
+      next_record_poll = curr_time + record_poll_ns;
+
+      // The records say what UDP lost so far.
+      if (test_socket->type() == SOCKETTYPE_UDP) {
+        uint32_t received;
+        client_records.Progress(&n, &received);
+        loss = n > received ? n - received : 0;
+        evaluate = true;
+      }
+    }
+    if (have_tcp_stats && curr_time >= next_sprt) {
+      next_sprt = curr_time + sprt_interval_ns;
+      test_stats.Stop();
+      n = test_pkt;
+      loss = test_stats.PacketRetransCount();
+      evaluate = true;
+    }
+    if (evaluate) {
+      ++sprt_evaluations;
+      test_result = tester.test_result(n, loss);
+      if (test_result == RESULT_PASS || test_result == RESULT_FAIL) {
+        std::cout << (test_result == RESULT_PASS ? "passed" : "failed")
+                  << " SPRT after " << n << " packets" << std::endl;
+        sprt_decision_ns = curr_time - outer_start_time;
+        result_set = true;
+        break;
+      }
+    }
+
+    if (next_start > curr_time + lead_ns) {
+      // If we have time left over, sleep the remainder. The deadline is
+      // absolute so oversleeping doesn't accumulate.
+      pacer.SleepUntil(next_start - lead_ns / 2);
+    } else if (curr_time > next_start) {
+      // Behind the schedule itself; with kernel pacing the queue ran dry.
+      uint64_t missed_ns = curr_time - next_start;
+      missed_total += missed_ns;
       missed_sleep++;
-      missed_max = std::max(missed_max, static_cast<uint64_t>(abs(left_over_ns)));
+      missed_max = std::max(missed_max, missed_ns);
       if (missed_total > (curr_time - outer_start_time) / 2) {
         // Inconclusive because the test failed to generate the traffic pattern
         test_result = RESULT_INCONCLUSIVE;
@@ -337,6 +516,13 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
     }
   }
 
+  if (kernel_paced) {
+    // The last packets are still waiting in the qdisc; let them leave before
+    // measuring the send rate and telling the client we're done.
+    uint64_t last_departure = outer_start_time + test_pkt * time_per_chunk_ns;
+    pacer.SleepUntil(last_departure);
+  }
+
   uint64_t outer_end_time = GetTimeNS();
   uint64_t delta_time = outer_end_time - outer_start_time;
   double delta_time_sec = static_cast<double>(delta_time) / NS_PER_SEC;
@@ -349,25 +535,24 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
     return RESULT_ERROR;
 
   uint32_t lost_packets = 0;
-  #ifdef USE_WEB100
-  // Traffic statistics from web100
+  // Traffic statistics from the TCP stack
   uint32_t application_write_queue = 0;
   uint32_t retransmit_queue = 0;
   uint32_t rtt_ms = 0;
   double rtt_sec = 0.0;
 
-  if (test_socket->type() == SOCKETTYPE_TCP) {
-    test_connection.Stop();
-    lost_packets = test_connection.PacketRetransCount();
-    application_write_queue = test_connection.ApplicationWriteQueueSize();
-    retransmit_queue = test_connection.RetransmitQueueSize();
-    rtt_ms = test_connection.SampleRTT();
+  if (have_tcp_stats) {
+    test_stats.Stop();
+    lost_packets = test_stats.PacketRetransCount();
+    application_write_queue = test_stats.ApplicationWriteQueueSize();
+    retransmit_queue = test_stats.RetransmitQueueSize();
+    rtt_ms = test_stats.SampleRTT();
     rtt_sec = static_cast<double>(rtt_ms) / MS_PER_SEC;
   }
-  #endif
 
   // Observed data rates
-  double send_rate = (generator.total_bytes_sent() * 8) / delta_time_sec;
+  const uint64_t test_bytes = generator.total_bytes_sent() - growth_bytes;
+  double send_rate = (test_bytes * 8) / delta_time_sec;
   double send_rate_delta_percent = (send_rate * 100) / (bytes_per_sec * 8);
 
   // Sleep statistics
@@ -378,51 +563,28 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
             << std::endl;
   std::cout << "count: " << missed_sleep << std::endl;
 
-  // Receive the data collected by the client
-  uint32_t data_size_obj;
-  mlab::Packet data_size_pkt =
-    ctrl_socket->Receive(sizeof(data_size_obj), &num_bytes);
-  if (num_bytes < 0 || static_cast<unsigned>(num_bytes) < sizeof(data_size_obj))
+  // The last send timestamps have had an rtt to come in.
+  generator.CollectTimestamps();
+
+  // Receive the rest of the data collected by the client
+  if (!client_records.Finish() ||
+      !client_records.CheckNonces(generator.records()))
     return RESULT_ERROR;
-  data_size_obj = ntohl(data_size_pkt.as<uint32_t>());
-
-  uint32_t data_size_bytes = data_size_obj * sizeof(TrafficData);
-  std::cout << "client data: " << data_size_bytes << " bytes" << std::endl;
-
-  std::vector<TrafficData> client_data(data_size_obj);
-  std::vector<uint8_t> bytes_buffer;
-  uint32_t total_recv_bytes = 0;
-  while (total_recv_bytes < data_size_bytes) {
-    uint32_t num_to_receive = std::min(static_cast<unsigned>(MAX_RECV_BYTES),
-                                       data_size_bytes - total_recv_bytes);
-    mlab::Packet recv_pkt = ctrl_socket->Receive(num_to_receive, &num_bytes);
-    if (num_bytes <= 0)
-      return RESULT_ERROR;
-    bytes_buffer.insert(bytes_buffer.end(),
-                        recv_pkt.buffer(),
-                        recv_pkt.buffer() + num_bytes);
-    total_recv_bytes += num_bytes;
-  }
   std::cout << "data collected" << std::endl;
-  const TrafficData* recv_buffer =
-      reinterpret_cast<const TrafficData*>(&bytes_buffer[0]);
-  for (uint32_t i=0; i < data_size_obj; ++i) {
-    client_data[i] = TrafficData::ntoh(recv_buffer[i]);
-  }
-
 
   if (test_socket->type() == SOCKETTYPE_UDP) {
-    lost_packets = generator.packets_sent() - data_size_obj;
+    // The same count the statistical test ran on while the test did.
+    uint32_t received = client_records.Received(generator.packets_sent());
+    lost_packets = test_pkt > received ? test_pkt - received : 0;
   }
 
-  std::cout << "\npackets sent: " << generator.packets_sent() << "\n";
-  std::cout << "bytes sent: " << generator.total_bytes_sent() << "\n";
+  std::cout << "\npackets sent: " << test_pkt << "\n";
+  std::cout << "bytes sent: " << test_bytes << "\n";
   std::cout << "time: " << delta_time_sec << "\n";
   std::cout << "send rate: " << send_rate << " b/sec ("
             << send_rate_delta_percent << "% of target)\n";
 
-  #ifdef USE_WEB100
-  if (test_socket->type() == SOCKETTYPE_TCP) {
+  if (have_tcp_stats) {
     std::cout << "  lost: " << lost_packets << "\n";
     std::cout << "  write queue: " << application_write_queue << "\n";
     std::cout << "  retransmit queue: " << retransmit_queue << "\n";
@@ -437,14 +599,13 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
       }
     }
   }
-  #endif
   if (test_socket->type() == SOCKETTYPE_UDP) {
     std::cout << "  lost: " << lost_packets << "\n";
   }
 
   // determine the result of the test
   if (test_socket->type() == SOCKETTYPE_UDP && !result_set)
-    test_result = tester.test_result(generator.packets_sent(), lost_packets);
+    test_result = tester.test_result(test_pkt, lost_packets);
 
   // print the result, and send it to the client
   if (test_result == RESULT_ERROR)
@@ -459,85 +620,74 @@ Result RunCBR(const mlab::AcceptedSocket* test_socket,
 
 
   
-  // setup log file directory
-  struct timespec test_time;
-  clock_gettime(CLOCK_REALTIME, &test_time);
-  struct tm* time_tm = gmtime(&test_time.tv_sec);
-  char buffer[20];
-  strftime(buffer, sizeof(buffer), "/%Y/%m/%d/", time_tm);
-  std::stringstream ss;
-  ss << FLAGS_prefix << buffer;
-
-  boost::system::error_code ec;
-  boost::filesystem::create_directories(ss.str(), ec);
-
-  // generate log file name
-  strftime(buffer, sizeof(buffer), "%Y%m%dT%T.", time_tm);
-  ss << buffer << test_time.tv_nsec << 'Z';
-  std::string file_name_prefix = ss.str();
+  // The logs are written by the log writer, once this session is done.
+  TestLog* log = new TestLog;
+  addr_to_bytes(&client_addr, log->client_addr);
+  log->rate_kb_s = config.cbr_kb_s;
+  log->result = test_result;
 
   // log the test configuration and summary data
-  std::ofstream fs_test;
-  fs_test.open((file_name_prefix + "_testdata").c_str());
-  fs_test << "server_ip_addr " << server_str << std::endl;
-  fs_test << "client_ip_addr " << client_str << std::endl;
-  fs_test << "socket_type "
-          << (test_socket->type() == SOCKETTYPE_TCP? "tcp": "udp") << std::endl;
-  fs_test << "target_rate_kb_s " << config.cbr_kb_s << std::endl;
-  fs_test << "target_rtt_ms " << config.rtt_ms << std::endl;
-  fs_test << "target_mss_bytes " << config.mss_bytes << std::endl;
-  fs_test << "target_pipe_size_pkt " << target_pipe_size << std::endl;
-  fs_test << "target_runlength_pkt " << target_run_length << std::endl;
-  fs_test << "packet_size " << bytes_per_chunk << std::endl;
-  fs_test << "ns_per_packet " << time_per_chunk_ns << std::endl;
-  fs_test << "packets_sent " << generator.packets_sent() << std::endl;
-  fs_test << "bytes_sent " << generator.total_bytes_sent() << std::endl;
-  fs_test << "total_time_ns " << delta_time << std::endl;
-  fs_test << "send_rate_bits_sec " << send_rate << std::endl;
-  fs_test << "missed_sleep_count " << missed_sleep << std::endl;
-  fs_test << "missed_sleep_maximum_ns " << missed_max << std::endl;
-  fs_test << "missed_sleep_average_ns "
-          << (missed_sleep == 0? 0 : missed_total / missed_sleep) << std::endl;
-  fs_test << "packet_loss " << lost_packets << std::endl;
-  fs_test << "type_I_err " << DEFAULT_TYPE_I_ERR << std::endl;
-  fs_test << "type_II_err " << DEFAULT_TYPE_II_ERR << std::endl;
-  fs_test << "test_result " << kResultStr[test_result] << std::endl;
-  #if USE_WEB100
+  std::ostringstream testdata;
+  testdata << "server_ip_addr " << server_str << '\n';
+  testdata << "client_ip_addr " << client_str << '\n';
+  testdata << "socket_type "
+           << (test_socket->type() == SOCKETTYPE_TCP? "tcp": "udp") << '\n';
+  testdata << "target_rate_kb_s " << config.cbr_kb_s << '\n';
+  testdata << "target_rtt_ms " << config.rtt_ms << '\n';
+  testdata << "target_mss_bytes " << config.mss_bytes << '\n';
+  testdata << "target_pipe_size_pkt " << target_pipe_size << '\n';
+  testdata << "target_runlength_pkt " << target_run_length << '\n';
+  testdata << "packet_size " << bytes_per_chunk << '\n';
+  testdata << "ns_per_packet " << time_per_chunk_ns << '\n';
+  testdata << "packets_sent " << test_pkt << '\n';
+  testdata << "bytes_sent " << test_bytes << '\n';
+  testdata << "nonce_seed " << generator.nonce_seed() << '\n';
+  testdata << "total_time_ns " << delta_time << '\n';
+  testdata << "send_rate_bits_sec " << send_rate << '\n';
+  testdata << "pacing_engine " << pacing_engine << '\n';
+  testdata << "pacing_lead_ns " << lead_ns << '\n';
+  // Of all packets sent, growth included; the rest carry the time their send
+  // call returned.
+  testdata << "kernel_send_timestamps " << generator.kernel_timestamps()
+           << '\n';
+  testdata << "hardware_send_timestamps " << generator.hardware_timestamps()
+           << '\n';
+  int64_t clock_error_ns, clock_max_error_ns;
+  GetClockError(&clock_error_ns, &clock_max_error_ns);
+  testdata << "clock_source " << ClockSourceName(GetClockSource()) << '\n';
+  testdata << "clock_max_error_ns " << clock_max_error_ns << '\n';
+  testdata << "clock_fell_back " << ClockFellBack() << '\n';
+  testdata << "missed_sleep_count " << missed_sleep << '\n';
+  testdata << "missed_sleep_maximum_ns " << missed_max << '\n';
+  testdata << "missed_sleep_average_ns "
+           << (missed_sleep == 0? 0 : missed_total / missed_sleep) << '\n';
+  testdata << "packet_loss " << lost_packets << '\n';
+  testdata << "type_I_err " << DEFAULT_TYPE_I_ERR << '\n';
+  testdata << "type_II_err " << DEFAULT_TYPE_II_ERR << '\n';
+  testdata << "test_result " << kResultStr[test_result] << '\n';
+  testdata << "sprt_evaluations " << sprt_evaluations << '\n';
+  // 0 if the test ran its full length.
+  testdata << "sprt_decision_latency_ns " << sprt_decision_ns << '\n';
   if (test_socket->type() == SOCKETTYPE_TCP) {
-    fs_test << "write_queue_at_end " << application_write_queue << std::endl;
-    fs_test << "retransmit_queue_at_end " << retransmit_queue << std::endl;
-    fs_test << "sample_rtt_ms " << rtt_ms << std::endl;
+    testdata << "tcp_stats " << TcpStatsSourceName(test_stats.source())
+             << '\n';
+    testdata << "growth_packets_sent " << growth_pkt << '\n';
   }
-  #endif
-  fs_test.close();
-  // log the client data
-  std::ofstream fs_client;
-  fs_client.open((file_name_prefix + "_clientdata").c_str());
-  // seq_no, nonce and timestamp
-  for (std::vector<TrafficData>::const_iterator it = client_data.begin();
-       it != client_data.end(); ++it) {
-    fs_client << it->seq_no() << ' ' << it->nonce()
-              << ' ' << it->timestamp() << std::endl;
+  if (have_tcp_stats) {
+    testdata << "write_queue_at_end " << application_write_queue << '\n';
+    testdata << "retransmit_queue_at_end " << retransmit_queue << '\n';
+    testdata << "sample_rtt_ms " << rtt_ms << '\n';
   }
-  fs_client.close();
-  // log the server data
-  std::ofstream fs_server;
-  fs_server.open((file_name_prefix + "_serverdata").c_str());
-  // seq_no, nonce and timestamp
-  #ifdef USE_WEB100
-  if (test_socket->type() == SOCKETTYPE_TCP) {
-    for (uint32_t i=0; i < growth_generator.packets_sent(); ++i) {
-      fs_server << i << ' ' << growth_generator.nonce()[i]
-                << ' ' << growth_generator.timestamps()[i] << std::endl;
-    }
-  }
-  #endif
-  for (uint32_t i=0; i < generator.packets_sent(); ++i) {
-    fs_server << i << ' ' << generator.nonce()[i]
-              << ' ' << generator.timestamps()[i] << std::endl;
-  }
-  fs_server.close();
-  
+  log->testdata = testdata.str();
+
+  // log the client and server data: seq_no, nonce and timestamp. The writer
+  // thread turns them into columns.
+  client_records.MoveRecordsTo(&log->received);
+  generator.MoveRecordsTo(&log->sent);
+
+  if (!log_writer->Submit(log))
+    std::cerr << "log queue full, test not logged" << std::endl;
+
   std::cout << "Done CBR" << std::endl;
   return test_result;
 }
@@ -9,10 +9,13 @@ class AcceptedSocket;
 
 namespace mbm {
 class Config;
+class LogWriter;
 
+// Hands the test's logs to log_writer once the result is sent.
 Result RunCBR(const mlab::AcceptedSocket* test_socket,
               const mlab::AcceptedSocket* ctrl_socket,
-              const Config& config);
+              const Config& config,
+              LogWriter* log_writer);
 }  // namespace mbm
 
 #endif  // SERVER_CBR_H
@@ -0,0 +1,548 @@
+#include "server/control_reactor.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "common/config.h"
+#include "common/constants.h"
+#include "common/nonce.h"
+#include "common/time.h"
+#include "mlab/accepted_socket.h"
+#include "mlab/listen_socket.h"
+#include "server/log_writer.h"
+#include "server/port_allocator.h"
+#include "server/session.h"
+#include "server/worker_pool.h"
+
+namespace mbm {
+namespace {
+const int kMaxEvents = 64;
+// How often handshakes are checked for timeouts.
+const int kTickMs = 250;
+// The Config of a client that doesn't send features.
+const size_t kBaselineConfigBytes = sizeof(Config) - sizeof(uint32_t);
+// Time allowed for each step of the handshake.
+const uint64_t kStepTimeoutNs =
+    static_cast<uint64_t>(DEFAULT_TIMEO_SEC) * NS_PER_SEC + DEFAULT_TIMEO_NS;
+
+// The test itself uses blocking calls on both sockets; these bound them.
+bool SetTimeouts(int fd) {
+  timeval timeout = {DEFAULT_TIMEO_SEC, DEFAULT_TIMEO_NS / 1000};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                 (const char*) &timeout, sizeof(timeout)) == -1) {
+    std::cout << "failed to set receive timeout" << std::endl;
+    return false;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+                 (const char*) &timeout, sizeof(timeout)) == -1) {
+    std::cout << "failed to set send timeout" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Appends whatever is waiting on fd to buffer, up to length bytes in total.
+// Returns false if the peer went away or the read failed.
+bool ReadUpTo(int fd, std::string* buffer, size_t length) {
+  while (buffer->size() < length) {
+    char bytes[64];
+    size_t wanted = std::min(sizeof(bytes), length - buffer->size());
+    ssize_t num_bytes = recv(fd, bytes, wanted, MSG_DONTWAIT);
+    if (num_bytes > 0) {
+      buffer->append(bytes, num_bytes);
+      continue;
+    }
+    if (num_bytes == 0)
+      return false;
+    if (errno == EINTR)
+      continue;
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+  }
+  return true;
+}
+}  // namespace
+
+struct ControlReactor::Handshake {
+  explicit Handshake(Session* session)
+      : session(session),
+        state(STATE_CONFIG),
+        token(0),
+        deadline_ns(GetTimeNS() + kStepTimeoutNs) {}
+
+  Session* session;
+  State state;
+  // Non-zero while the test connection is expected on the shared port.
+  uint32_t token;
+  // Bytes received so far on each socket for the current step.
+  std::string ctrl_bytes;
+  std::string test_bytes;
+  uint64_t deadline_ns;
+};
+
+struct ControlReactor::SharedTest {
+  explicit SharedTest(const mlab::AcceptedSocket* socket)
+      : socket(socket),
+        deadline_ns(GetTimeNS() + kStepTimeoutNs) {}
+
+  const mlab::AcceptedSocket* socket;
+  // The token and READY, as far as they've arrived.
+  std::string bytes;
+  uint64_t deadline_ns;
+};
+
+ControlReactor::ControlReactor(const mlab::ListenSocket* listen_socket,
+                               const mlab::ListenSocket* shared_socket,
+                               uint16_t shared_port,
+                               PortAllocator* ports, WorkerPool* workers,
+                               LogWriter* log_writer,
+                               uint32_t stats_interval_sec)
+    : epoll_fd_(epoll_create1(0)),
+      listen_socket_(listen_socket),
+      shared_socket_(shared_socket),
+      shared_port_(shared_port),
+      ports_(ports),
+      workers_(workers),
+      log_writer_(log_writer),
+      stats_interval_ns_(static_cast<uint64_t>(stats_interval_sec) *
+                         NS_PER_SEC),
+      next_stats_ns_(GetTimeNS() + stats_interval_ns_) {
+}
+
+ControlReactor::~ControlReactor() {
+  while (!handshakes_.empty())
+    Close(*handshakes_.begin());
+  while (!shared_tests_.empty())
+    CloseSharedTest(shared_tests_.begin()->second);
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+}
+
+bool ControlReactor::Run() {
+  if (epoll_fd_ < 0) {
+    std::cerr << "Failed to create epoll: " << strerror(errno) << "\n";
+    return false;
+  }
+
+  // Connections can go away between the wakeup and accept(); don't block on
+  // them. Accepted sockets don't inherit this.
+  const int listen_fd = listen_socket_->raw();
+  fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+  if (!Watch(listen_fd))
+    return false;
+  const int shared_fd = shared_socket_ ? shared_socket_->raw() : -1;
+  if (shared_socket_) {
+    fcntl(shared_fd, F_SETFL, fcntl(shared_fd, F_GETFL) | O_NONBLOCK);
+    if (!Watch(shared_fd))
+      return false;
+  }
+
+  epoll_event events[kMaxEvents];
+  while (true) {
+    int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, kTickMs);
+    if (num_events < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+      return false;
+    }
+
+    for (int i = 0; i < num_events; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listen_fd) {
+        OnConnection();
+        continue;
+      }
+      if (fd == shared_fd) {
+        OnSharedConnection();
+        continue;
+      }
+      // An earlier event in this batch may have closed the handshake.
+      std::map<int, Handshake*>::iterator it = fds_.find(fd);
+      if (it != fds_.end()) {
+        OnEvent(it->second, fd);
+        continue;
+      }
+      std::map<int, SharedTest*>::iterator shared = shared_tests_.find(fd);
+      if (shared != shared_tests_.end())
+        OnSharedTest(shared->second);
+    }
+    ExpireHandshakes();
+
+    if (stats_interval_ns_ != 0 && GetTimeNS() >= next_stats_ns_) {
+      workers_->PrintStats();
+      log_writer_->PrintStats();
+      next_stats_ns_ += stats_interval_ns_;
+    }
+  }
+  return false;
+}
+
+void ControlReactor::OnConnection() {
+  const mlab::AcceptedSocket* ctrl_socket = listen_socket_->Accept();
+  if (!ctrl_socket)
+    return;
+  std::cout << "New connection\n";
+
+  Handshake* handshake = new Handshake(new Session(ctrl_socket, ports_,
+                                                  log_writer_));
+  handshakes_.insert(handshake);
+  if (!SetTimeouts(ctrl_socket->raw()) ||
+      !Watch(ctrl_socket->raw(), handshake))
+    Close(handshake);
+}
+
+void ControlReactor::OnEvent(Handshake* handshake, int fd) {
+  bool ok;
+  if (handshake->state == STATE_CONFIG)
+    ok = OnConfig(handshake);
+  else if (handshake->state == STATE_ACCEPT &&
+           fd != handshake->session->ctrl_socket->raw())
+    ok = OnTestConnection(handshake);
+  else
+    ok = OnReady(handshake);
+  if (!ok)
+    Close(handshake);
+}
+
+bool ControlReactor::OnConfig(Handshake* handshake) {
+  Session* session = handshake->session;
+  const int ctrl_fd = session->ctrl_socket->raw();
+  // The first word tells a hello from the start of a baseline Config.
+  if (!ReadUpTo(ctrl_fd, &handshake->ctrl_bytes, sizeof(uint32_t))) {
+    std::cout << "failed to receive config" << std::endl;
+    return false;
+  }
+  if (handshake->ctrl_bytes.size() < sizeof(uint32_t))
+    return true;
+  uint32_t hello;
+  memcpy(&hello, handshake->ctrl_bytes.data(), sizeof(hello));
+  hello = ntohl(hello);
+  const bool has_hello = (hello & kProtocolMagicMask) == kProtocolMagic;
+  ssize_t num_bytes;
+  if (has_hello && hello != kProtocolHello) {
+    std::cout << "client speaks protocol version "
+              << (hello & ~kProtocolMagicMask) << ", not "
+              << kProtocolVersion << std::endl;
+    // Let it know which one we speak before hanging up.
+    session->ctrl_socket->Send(mlab::Packet(htonl(kProtocolHello)),
+                               &num_bytes);
+    return false;
+  }
+
+  const size_t config_offset = has_hello ? sizeof(uint32_t) : 0;
+  const size_t config_bytes = has_hello ? sizeof(Config) : kBaselineConfigBytes;
+  if (!ReadUpTo(ctrl_fd, &handshake->ctrl_bytes,
+                config_offset + config_bytes)) {
+    std::cout << "failed to receive config" << std::endl;
+    return false;
+  }
+  if (handshake->ctrl_bytes.size() < config_offset + config_bytes)
+    return true;
+  // A baseline client gets no features.
+  session->config = Config();
+  memcpy(&session->config, handshake->ctrl_bytes.data() + config_offset,
+         config_bytes);
+  handshake->ctrl_bytes.clear();
+  const Config& config = session->config;
+
+  std::cout << "Setting config [" << config.socket_type << " | "
+            << config.cbr_kb_s << " kb/s | " << config.rtt_ms << " ms | "
+            << config.mss_bytes << " bytes" << " ]\n";
+
+  // No point in handing out a port for a test that can't run.
+  if (workers_->Saturated()) {
+    std::cout << "all workers busy, rejecting test" << std::endl;
+    return false;
+  }
+
+  if (has_hello &&
+      !session->ctrl_socket->Send(mlab::Packet(htonl(kProtocolHello)),
+                                  &num_bytes)) {
+    std::cout << "failed to send hello" << std::endl;
+    return false;
+  }
+  session->hello = has_hello;
+
+  const bool wants_token = (config.features & FEATURE_SESSION_TOKEN) != 0;
+  if (shared_socket_ && wants_token && config.socket_type == SOCKETTYPE_TCP) {
+    // The test connection will show up on the shared port; pick a token for
+    // it to find us by. Whoever guesses it can take the test connection over,
+    // so it comes from /dev/urandom.
+    uint32_t token;
+    do {
+      token = static_cast<uint32_t>(RandomSeed());
+    } while (token == 0 || tokens_.count(token) != 0);
+
+    std::cout << "Telling client to connect on shared port " << shared_port_
+              << " with token " << token << "\n";
+    if (!session->ctrl_socket->Send(mlab::Packet(htons(shared_port_)),
+                                    &num_bytes) ||
+        !session->ctrl_socket->Send(mlab::Packet(htonl(token)),
+                                    &num_bytes)) {
+      std::cout << "failed to send port" << std::endl;
+      return false;
+    }
+
+    handshake->token = token;
+    tokens_[token] = handshake;
+    handshake->state = STATE_READY;
+    handshake->deadline_ns = GetTimeNS() + kStepTimeoutNs;
+    std::cout << "Waiting for READY\n";
+    return true;
+  }
+
+  // create listen socket, if error occurs pick another port
+  // if error occurs more than 3 times terminate the test
+  if (!ports_->Acquire(&session->port)) {
+    std::cout << "no test ports available" << std::endl;
+    return false;
+  }
+  for (int count = 0; count < NUM_PORTS_TO_TRY; ++count) {
+    session->listen_socket =
+        mlab::ListenSocket::Create(session->port, config.socket_type);
+    if (session->listen_socket) break;
+
+    uint16_t current = session->port;
+    bool acquired = ports_->Acquire(&session->port);
+    ports_->Release(current);
+    if (!acquired) {
+      session->port = 0;
+      break;
+    }
+  }
+  if (!session->listen_socket) {
+    std::cout << "failed to create listen socket" << std::endl;
+    return false;
+  }
+
+  std::cout << "Listening on " << session->port << "\n";
+
+  // Let the client know that they can connect. A client that can take a
+  // token gets 0: this test has a port of its own.
+  std::cout << "Telling client to connect on port " << session->port << "\n";
+  if (!session->ctrl_socket->Send(mlab::Packet(htons(session->port)),
+                                  &num_bytes) ||
+      (wants_token &&
+       !session->ctrl_socket->Send(mlab::Packet(htonl(0)), &num_bytes))) {
+    std::cout << "failed to send port" << std::endl;
+    return false;
+  }
+
+  if (!Watch(session->listen_socket->raw(), handshake))
+    return false;
+  handshake->state = STATE_ACCEPT;
+  handshake->deadline_ns = GetTimeNS() + kStepTimeoutNs;
+  return true;
+}
+
+bool ControlReactor::OnTestConnection(Handshake* handshake) {
+  Session* session = handshake->session;
+  const mlab::AcceptedSocket* test_socket = session->listen_socket->Accept();
+  if (!test_socket) {
+    std::cout << "failed to accept test connection" << std::endl;
+    return false;
+  }
+  session->test_socket = test_socket;
+
+  // For UDP the test socket may be the listen socket itself, so stop
+  // watching before watching again.
+  Unwatch(session->listen_socket->raw());
+  if (!SetTimeouts(test_socket->raw()) ||
+      !Watch(test_socket->raw(), handshake))
+    return false;
+
+  std::cout << "Waiting for READY\n";
+  handshake->state = STATE_READY;
+  handshake->deadline_ns = GetTimeNS() + kStepTimeoutNs;
+  return true;
+}
+
+bool ControlReactor::OnReady(Handshake* handshake) {
+  Session* session = handshake->session;
+  const size_t ready_len = strlen(READY);
+
+  // Stop watching each socket once its READY is in, so that anything the
+  // client sends early doesn't keep waking us up.
+  const int ctrl_fd = session->ctrl_socket->raw();
+  if (fds_.count(ctrl_fd) != 0) {
+    if (!ReadUpTo(ctrl_fd, &handshake->ctrl_bytes, ready_len)) {
+      std::cout << "failed to receive ready" << std::endl;
+      return false;
+    }
+    if (handshake->ctrl_bytes.size() == ready_len)
+      Unwatch(ctrl_fd);
+  }
+  if (session->test_socket && fds_.count(session->test_socket->raw()) != 0) {
+    const int test_fd = session->test_socket->raw();
+    if (!ReadUpTo(test_fd, &handshake->test_bytes, ready_len)) {
+      std::cout << "failed to receive ready" << std::endl;
+      return false;
+    }
+    if (handshake->test_bytes.size() == ready_len)
+      Unwatch(test_fd);
+  }
+
+  if (handshake->ctrl_bytes.size() < ready_len ||
+      handshake->test_bytes.size() < ready_len)
+    return true;
+  if (handshake->ctrl_bytes != READY || handshake->test_bytes != READY) {
+    std::cout << "failed to receive ready" << std::endl;
+    return false;
+  }
+
+  ssize_t num_bytes;
+  if (!session->ctrl_socket->Send(mlab::Packet(READY, strlen(READY)),
+                                  &num_bytes)) {
+    std::cout << "failed to send ready" << std::endl;
+    return false;
+  }
+
+  Start(handshake);
+  return true;
+}
+
+void ControlReactor::OnSharedConnection() {
+  const mlab::AcceptedSocket* socket = shared_socket_->Accept();
+  if (!socket)
+    return;
+
+  SharedTest* shared_test = new SharedTest(socket);
+  if (!SetTimeouts(socket->raw()) || !Watch(socket->raw())) {
+    delete socket;
+    delete shared_test;
+    return;
+  }
+  shared_tests_[socket->raw()] = shared_test;
+}
+
+void ControlReactor::OnSharedTest(SharedTest* shared_test) {
+  const size_t hello_len = sizeof(uint32_t) + strlen(READY);
+  if (!ReadUpTo(shared_test->socket->raw(), &shared_test->bytes, hello_len)) {
+    CloseSharedTest(shared_test);
+    return;
+  }
+  if (shared_test->bytes.size() < hello_len)
+    return;
+
+  uint32_t token;
+  memcpy(&token, shared_test->bytes.data(), sizeof(token));
+  std::map<uint32_t, Handshake*>::iterator it = tokens_.find(ntohl(token));
+  if (it == tokens_.end()) {
+    std::cout << "unknown session token " << ntohl(token) << std::endl;
+    CloseSharedTest(shared_test);
+    return;
+  }
+
+  // The test connection now belongs to the session, READY included.
+  Handshake* handshake = it->second;
+  tokens_.erase(it);
+  handshake->token = 0;
+  handshake->session->test_socket = shared_test->socket;
+  handshake->test_bytes = shared_test->bytes.substr(sizeof(uint32_t));
+  Unwatch(shared_test->socket->raw());
+  shared_tests_.erase(shared_test->socket->raw());
+  delete shared_test;
+
+  if (!OnReady(handshake))
+    Close(handshake);
+}
+
+void ControlReactor::CloseSharedTest(SharedTest* shared_test) {
+  Unwatch(shared_test->socket->raw());
+  shared_tests_.erase(shared_test->socket->raw());
+  delete shared_test->socket;
+  delete shared_test;
+}
+
+void ControlReactor::Start(Handshake* handshake) {
+  Session* session = handshake->session;
+  Unwatch(session->ctrl_socket->raw());
+  Unwatch(session->test_socket->raw());
+  handshakes_.erase(handshake);
+  delete handshake;
+
+  // The client has READY and waits for the test to start, so a session that
+  // can't be queued any more is told so rather than just dropped.
+  if (!workers_->Submit(session)) {
+    std::cout << "all workers busy, rejecting test" << std::endl;
+    RejectSession(session);
+  }
+}
+
+void ControlReactor::Close(Handshake* handshake) {
+  std::map<int, Handshake*>::iterator it = fds_.begin();
+  while (it != fds_.end()) {
+    if (it->second == handshake) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->first, NULL);
+      fds_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (handshake->token != 0)
+    tokens_.erase(handshake->token);
+  handshakes_.erase(handshake);
+  delete handshake->session;
+  delete handshake;
+}
+
+void ControlReactor::ExpireHandshakes() {
+  uint64_t now = GetTimeNS();
+  std::vector<Handshake*> expired;
+  for (std::set<Handshake*>::const_iterator it = handshakes_.begin();
+       it != handshakes_.end(); ++it) {
+    if ((*it)->deadline_ns < now)
+      expired.push_back(*it);
+  }
+  for (size_t i = 0; i < expired.size(); ++i) {
+    std::cout << "handshake timed out" << std::endl;
+    Close(expired[i]);
+  }
+
+  std::vector<SharedTest*> expired_tests;
+  for (std::map<int, SharedTest*>::const_iterator it = shared_tests_.begin();
+       it != shared_tests_.end(); ++it) {
+    if (it->second->deadline_ns < now)
+      expired_tests.push_back(it->second);
+  }
+  for (size_t i = 0; i < expired_tests.size(); ++i)
+    CloseSharedTest(expired_tests[i]);
+
+  workers_->ExpireQueued();
+}
+
+bool ControlReactor::Watch(int fd) {
+  epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+    std::cout << "failed to watch socket: " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool ControlReactor::Watch(int fd, Handshake* handshake) {
+  if (!Watch(fd))
+    return false;
+  fds_[fd] = handshake;
+  return true;
+}
+
+void ControlReactor::Unwatch(int fd) {
+  if (fds_.erase(fd) != 0 || shared_tests_.count(fd) != 0)
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+}
+
+}  // namespace mbm
@@ -0,0 +1,93 @@
+#ifndef SERVER_CONTROL_REACTOR_H
+#define SERVER_CONTROL_REACTOR_H
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+namespace mlab {
+class AcceptedSocket;
+class ListenSocket;
+}  // namespace mlab
+
+namespace mbm {
+class LogWriter;
+class PortAllocator;
+struct Session;
+class WorkerPool;
+
+// Runs the control handshake of every connection on one epoll loop: config,
+// test port, test connection and READY. None of these steps blocks; a
+// session only goes to a pacing worker once it is ready to transmit.
+//
+// With a shared test socket, TCP tests from clients that support it don't
+// get a port of their own. They get a session token instead, and connect to
+// the shared port and send the token ahead of READY, which is how their test
+// connection finds its session.
+class ControlReactor {
+  public:
+    // Doesn't take ownership of any of them. shared_socket may be NULL.
+    // Worker and log stats are printed every stats_interval_sec, if it's
+    // not 0.
+    ControlReactor(const mlab::ListenSocket* listen_socket,
+                   const mlab::ListenSocket* shared_socket,
+                   uint16_t shared_port,
+                   PortAllocator* ports, WorkerPool* workers,
+                   LogWriter* log_writer, uint32_t stats_interval_sec);
+    ~ControlReactor();
+
+    // Only returns if epoll fails.
+    bool Run();
+
+  private:
+    enum State {
+      STATE_CONFIG,  // waiting for the Config on the control socket
+      STATE_ACCEPT,  // waiting for the client on the test port
+      STATE_READY    // waiting for READY on both sockets
+    };
+    struct Handshake;
+    // A connection on the shared test port that hasn't sent its token yet.
+    struct SharedTest;
+
+    void OnConnection();
+    void OnSharedConnection();
+    void OnSharedTest(SharedTest* shared_test);
+    void CloseSharedTest(SharedTest* shared_test);
+    void OnEvent(Handshake* handshake, int fd);
+    bool OnConfig(Handshake* handshake);
+    bool OnTestConnection(Handshake* handshake);
+    bool OnReady(Handshake* handshake);
+    // Hands a finished handshake's session to the workers.
+    void Start(Handshake* handshake);
+    // Drops a handshake and everything it owns.
+    void Close(Handshake* handshake);
+    // Drops handshakes past their step's deadline, and rejects queued
+    // sessions that waited too long for a worker.
+    void ExpireHandshakes();
+
+    bool Watch(int fd);
+    bool Watch(int fd, Handshake* handshake);
+    void Unwatch(int fd);
+
+    int epoll_fd_;
+    const mlab::ListenSocket* listen_socket_;
+    const mlab::ListenSocket* shared_socket_;
+    uint16_t shared_port_;
+    PortAllocator* ports_;
+    WorkerPool* workers_;
+    LogWriter* log_writer_;
+    uint64_t stats_interval_ns_;
+    uint64_t next_stats_ns_;
+    std::set<Handshake*> handshakes_;
+    // Every socket fd we're watching, to the handshake it belongs to.
+    std::map<int, Handshake*> fds_;
+    std::map<int, SharedTest*> shared_tests_;
+    // Handshakes waiting for their test connection on the shared port.
+    std::map<uint32_t, Handshake*> tokens_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_CONTROL_REACTOR_H
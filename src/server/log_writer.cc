@@ -0,0 +1,291 @@
+#include "server/log_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+#include "common/constants.h"
+#include "common/time.h"
+
+namespace mbm {
+namespace {
+// Lays out the records the session handed over as columns, and lets go of
+// them.
+void FillColumns(TestLog* log) {
+  log->client.Reserve(log->received.size());
+  for (std::vector<TrafficData>::const_iterator it = log->received.begin();
+       it != log->received.end(); ++it)
+    log->client.Append(it->seq_no(), it->nonce(), it->timestamp());
+  std::vector<TrafficData>().swap(log->received);
+
+  log->server.Reserve(log->sent.size());
+  for (SendRecords::const_iterator it = log->sent.begin();
+       it != log->sent.end(); ++it)
+    log->server.Append(it.seq_no(), it.nonce(), it.timestamp());
+  SendRecords none(0, NonceSequence(0));
+  log->sent.swap(none);
+}
+}  // namespace
+
+bool ParseFsyncPolicy(const std::string& value, FsyncPolicy* policy) {
+  if (value == "none")
+    *policy = FSYNC_NONE;
+  else if (value == "file")
+    *policy = FSYNC_FILE;
+  else if (value == "batch")
+    *policy = FSYNC_BATCH;
+  else
+    return false;
+  return true;
+}
+
+bool ParseLogStore(const std::string& value, LogStore* store) {
+  if (value == "files")
+    *store = LOG_STORE_FILES;
+  else if (value == "segments")
+    *store = LOG_STORE_SEGMENTS;
+  else
+    return false;
+  return true;
+}
+
+LogWriter::LogWriter(const std::string& prefix, bool binary, LogStore store,
+                     uint64_t segment_bytes, uint32_t max_queued,
+                     FsyncPolicy fsync_policy)
+    : prefix_(prefix),
+      binary_(binary || store == LOG_STORE_SEGMENTS),
+      store_(store),
+      segment_bytes_(segment_bytes),
+      max_queued_(max_queued),
+      fsync_policy_(fsync_policy),
+      started_(false),
+      stopping_(false),
+      max_depth_(0),
+      written_(0),
+      dropped_(0),
+      failed_(0),
+      batches_(0),
+      write_ns_(0),
+      max_write_ns_(0),
+      queued_ns_(0),
+      max_queued_ns_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+}
+
+LogWriter::~LogWriter() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  if (started_)
+    pthread_join(thread_, NULL);
+  while (!queue_.empty()) {
+    delete queue_.front().log;
+    queue_.pop_front();
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool LogWriter::Start() {
+  int rc = pthread_create(&thread_, NULL, WriterThread, this);
+  if (rc != 0) {
+    std::cerr << "Failed to create thread: " << strerror(rc) << " ["
+              << rc << "]\n";
+    return false;
+  }
+  started_ = true;
+  return true;
+}
+
+bool LogWriter::Submit(TestLog* log) {
+  pthread_mutex_lock(&mutex_);
+  if (queue_.size() >= max_queued_) {
+    ++dropped_;
+    pthread_mutex_unlock(&mutex_);
+    delete log;
+    return false;
+  }
+  // Stamped under the lock so that the queue, and so every segment index,
+  // is in time order.
+  clock_gettime(CLOCK_REALTIME, &log->test_time);
+  Entry entry = {log, GetTimeNS()};
+  queue_.push_back(entry);
+  max_depth_ = std::max(max_depth_, static_cast<uint32_t>(queue_.size()));
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+void LogWriter::PrintStats() {
+  pthread_mutex_lock(&mutex_);
+  const uint64_t ns_per_ms = NS_PER_SEC / MS_PER_SEC;
+  uint64_t done = written_ + failed_;
+  std::cout << "logs: queued " << queue_.size()
+            << " max_queued " << max_depth_
+            << " written " << written_
+            << " failed " << failed_
+            << " dropped " << dropped_
+            << " batches " << batches_ << "\n"
+            << "  write_ms avg " << (done == 0 ? 0 : write_ns_ / done / ns_per_ms)
+            << " max " << max_write_ns_ / ns_per_ms
+            << " queued_ms avg "
+            << (done == 0 ? 0 : queued_ns_ / done / ns_per_ms)
+            << " max " << max_queued_ns_ / ns_per_ms << "\n" << std::flush;
+  pthread_mutex_unlock(&mutex_);
+}
+
+// static
+void* LogWriter::WriterThread(void* writer) {
+  reinterpret_cast<LogWriter*>(writer)->Work();
+  return NULL;
+}
+
+void LogWriter::Work() {
+  std::deque<Entry> batch;
+  pthread_mutex_lock(&mutex_);
+  while (true) {
+    while (queue_.empty() && !stopping_)
+      pthread_cond_wait(&cond_, &mutex_);
+    // Finish what's queued even when stopping.
+    if (queue_.empty())
+      break;
+    // Take everything that's waiting; it's written and synced together.
+    batch.swap(queue_);
+    pthread_mutex_unlock(&mutex_);
+
+    std::vector<uint64_t> write_ns(batch.size());
+    std::vector<bool> ok(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+      uint64_t start = GetTimeNS();
+      FillColumns(batch[i].log);
+      ok[i] = Write(*batch[i].log);
+      write_ns[i] = GetTimeNS() - start;
+      delete batch[i].log;
+    }
+    if (fsync_policy_ == FSYNC_BATCH && !directory_.empty())
+      Sync(directory_);
+    uint64_t done_ns = GetTimeNS();
+
+    pthread_mutex_lock(&mutex_);
+    ++batches_;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (ok[i])
+        ++written_;
+      else
+        ++failed_;
+      write_ns_ += write_ns[i];
+      max_write_ns_ = std::max(max_write_ns_, write_ns[i]);
+      uint64_t queued_ns = done_ns - batch[i].queued_ns;
+      queued_ns_ += queued_ns;
+      max_queued_ns_ = std::max(max_queued_ns_, queued_ns);
+    }
+    batch.clear();
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool LogWriter::Write(const TestLog& log) {
+  const std::string directory = prefix_ + LogDirectory(log.test_time);
+  if (!CreateDirectory(directory))
+    return false;
+  if (store_ == LOG_STORE_SEGMENTS)
+    return Append(log, directory);
+
+  const std::string file_name_prefix = directory + LogName(log.test_time);
+  std::vector<std::string> paths;
+  paths.push_back(file_name_prefix + "_testdata");
+  std::ofstream fs_test(paths.back().c_str());
+  fs_test << log.testdata;
+  fs_test.close();
+  if (!fs_test) {
+    std::cerr << "failed to write " << paths.back() << "\n";
+    return false;
+  }
+
+  if (binary_) {
+    paths.push_back(file_name_prefix + kLogFileSuffix);
+    if (!WriteLogFile(paths.back(), log.testdata, log.server, log.client))
+      return false;
+  } else {
+    paths.push_back(file_name_prefix + "_clientdata");
+    if (!WriteTextRecords(paths.back(), log.client.view()))
+      return false;
+    paths.push_back(file_name_prefix + "_serverdata");
+    if (!WriteTextRecords(paths.back(), log.server.view()))
+      return false;
+  }
+
+  if (fsync_policy_ == FSYNC_FILE) {
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (!Sync(paths[i]))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool LogWriter::Append(const TestLog& log, const std::string& directory) {
+  if (!segment_.is_open() || directory != segment_directory_ ||
+      segment_.size() >= segment_bytes_) {
+    // Segments are named after the first test in them.
+    const std::string path = directory + LogName(log.test_time) +
+                             kSegmentSuffix;
+    if (!segment_.Open(path))
+      return false;
+    segment_directory_ = directory;
+  }
+
+  SegmentIndexEntry entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.time_ns = static_cast<uint64_t>(log.test_time.tv_sec) * NS_PER_SEC +
+                  log.test_time.tv_nsec;
+  memcpy(entry.client_addr, log.client_addr, sizeof(entry.client_addr));
+  entry.rate_kb_s = log.rate_kb_s;
+  entry.result = log.result;
+  return segment_.Append(entry, log.testdata, log.server, log.client,
+                         fsync_policy_ == FSYNC_FILE);
+}
+
+bool LogWriter::CreateDirectory(const std::string& directory) {
+  if (directory == directory_)
+    return true;
+  boost::system::error_code ec;
+  boost::filesystem::create_directories(directory, ec);
+  if (ec) {
+    std::cerr << "failed to create " << directory << ": " << ec.message()
+              << "\n";
+    return false;
+  }
+  directory_ = directory;
+  return true;
+}
+
+bool LogWriter::Sync(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "failed to open " << path << ": " << strerror(errno) << "\n";
+    return false;
+  }
+#ifdef OS_FREEBSD
+  int rc = fsync(fd);
+#else
+  // For a directory this syncs the whole file system, which is what a batch
+  // wants; for a file it's more than needed, so files use fsync.
+  int rc = fsync_policy_ == FSYNC_BATCH ? syncfs(fd) : fsync(fd);
+#endif
+  if (rc != 0)
+    std::cerr << "failed to sync " << path << ": " << strerror(errno) << "\n";
+  close(fd);
+  return rc == 0;
+}
+
+}  // namespace mbm
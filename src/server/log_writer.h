@@ -0,0 +1,133 @@
+#ifndef SERVER_LOG_WRITER_H
+#define SERVER_LOG_WRITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common/log_file.h"
+#include "common/nonce.h"
+#include "common/segment_store.h"
+#include "common/traffic_data.h"
+#include "server/send_records.h"
+
+namespace mbm {
+
+// A finished test's logs, waiting to be written. Sessions hand over the
+// records they collected, and the writer thread lays them out in columns, so
+// the session neither copies nor converts anything on the way.
+struct TestLog {
+  TestLog() : sent(0, NonceSequence(0)) {}
+
+  // Set by Submit. Names the files, see LogDirectory and LogName.
+  timespec test_time;
+  std::string testdata;
+  // What the server sent and what the client received. Emptied into server
+  // and client before the log is written.
+  SendRecords sent;
+  std::vector<TrafficData> received;
+  RecordColumns server;
+  RecordColumns client;
+  // For the segment index.
+  uint8_t client_addr[16];
+  uint32_t rate_kb_s;
+  uint32_t result;
+};
+
+enum LogStore {
+  // A few files per test.
+  LOG_STORE_FILES,
+  // Appended to rolling segments, see segment_store.h. Implies the binary
+  // format.
+  LOG_STORE_SEGMENTS
+};
+
+// Parses "files" or "segments". Returns false for anything else.
+bool ParseLogStore(const std::string& value, LogStore* store);
+
+enum FsyncPolicy {
+  FSYNC_NONE,
+  // Every file is synced before the next one is written.
+  FSYNC_FILE,
+  // The file system is synced once per batch of logs.
+  FSYNC_BATCH
+};
+
+// Parses "none", "file" or "batch". Returns false for anything else.
+bool ParseFsyncPolicy(const std::string& value, FsyncPolicy* policy);
+
+// Writes test logs on a thread of its own, so that sessions return as soon
+// as their result is sent. Logs wait in a bounded queue; when it's full new
+// ones are dropped rather than holding up the tests.
+class LogWriter {
+  public:
+    // With LOG_STORE_SEGMENTS, a new segment is started every day and
+    // whenever the current one reaches segment_bytes.
+    LogWriter(const std::string& prefix, bool binary, LogStore store,
+              uint64_t segment_bytes, uint32_t max_queued,
+              FsyncPolicy fsync_policy);
+    // Writes what is still queued before returning.
+    ~LogWriter();
+
+    bool Start();
+    // Takes ownership of the log and stamps its time. Returns false, having
+    // dropped it, if the queue is full.
+    bool Submit(TestLog* log);
+    // Queue depth, logs written and dropped, and write latencies.
+    void PrintStats();
+
+  private:
+    struct Entry {
+      TestLog* log;
+      uint64_t queued_ns;
+    };
+
+    static void* WriterThread(void* writer);
+    void Work();
+    // Writes one test's files, syncing them with FSYNC_FILE.
+    bool Write(const TestLog& log);
+    // Appends one test to the current segment, starting a new one first if
+    // it's time to.
+    bool Append(const TestLog& log, const std::string& directory);
+    // Creates directory under the prefix unless it was the last one created.
+    bool CreateDirectory(const std::string& directory);
+    // fsync()s a file, or with FSYNC_BATCH syncs the file system it's on.
+    bool Sync(const std::string& path);
+
+    std::string prefix_;
+    bool binary_;
+    LogStore store_;
+    uint64_t segment_bytes_;
+    uint32_t max_queued_;
+    FsyncPolicy fsync_policy_;
+    // The last directory created, so a day's logs only create it once.
+    std::string directory_;
+    SegmentWriter segment_;
+    std::string segment_directory_;
+
+    pthread_t thread_;
+    bool started_;
+    bool stopping_;
+    std::deque<Entry> queue_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+
+    // Stats, under mutex_.
+    uint32_t max_depth_;
+    uint64_t written_;
+    uint64_t dropped_;
+    uint64_t failed_;
+    uint64_t batches_;
+    uint64_t write_ns_;
+    uint64_t max_write_ns_;
+    uint64_t queued_ns_;
+    uint64_t max_queued_ns_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_LOG_WRITER_H
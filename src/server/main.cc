@@ -1,35 +1,57 @@
-#include <assert.h>
-#include <errno.h>
-#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#ifdef USE_WEB100
-extern "C" {
-#include <web100/web100.h>
-}
-#endif
 
+#include <algorithm>
 #include <iostream>
+#include <boost/filesystem.hpp>
 
-#include "common/config.h"
 #include "common/constants.h"
 #include "common/scoped_ptr.h"
+#include "common/time.h"
 #include "gflags/gflags.h"
-#include "mlab/accepted_socket.h"
 #include "mlab/mlab.h"
 #include "mlab/listen_socket.h"
-#include "server/cbr.h"
-#ifdef USE_WEB100
-#include "server/web100.h"
-#endif  // USE_WEB100
-
-// TODO: configuration
-#define BASE_PORT 12345
-#define NUM_PORTS 100
+#include "server/control_reactor.h"
+#include "server/log_writer.h"
+#include "server/port_allocator.h"
+#include "server/worker_pool.h"
 
 DEFINE_int32(port, 4242, "The port to listen on");
+DEFINE_int32(base_port, 12345, "The first port handed out for test traffic");
+DEFINE_int32(num_ports, 1000, "The number of test ports, and so of tests in "
+                              "progress at once");
+DEFINE_int32(shared_test_port, 0, "If set, TCP tests from clients that "
+                                  "support it all connect to this port and "
+                                  "are told apart by a session token");
 DEFINE_bool(verbose, false, "Verbose output");
+DEFINE_int32(workers, 0, "The number of tests that run at once. 0 uses one "
+                         "per CPU");
+DEFINE_int32(max_queued_tests, 16, "The number of ready tests that wait for a "
+                                   "worker before new ones are rejected");
+DEFINE_int32(max_queue_wait_ms, 2000, "How long a ready test waits for a "
+                                     "worker before it is rejected. Clients "
+                                     "give up after 5 seconds");
+DEFINE_bool(pin_workers, true, "Pin each worker to its own CPU");
+DEFINE_int32(stats_interval_sec, 60, "How often to print worker and log "
+                                     "statistics. 0 never does");
+DEFINE_string(prefix, ".", "The root of the log directory");
+DEFINE_string(log_format, "binary", "How to log the packets of each test: "
+                                    "'binary' writes one columnar file, "
+                                    "'text' the _serverdata and _clientdata "
+                                    "files");
+DEFINE_string(log_store, "files", "Where tests are logged: 'files' under "
+                                  "the day's directory, or 'segments' that "
+                                  "hold many tests each, with an index");
+DEFINE_int32(log_segment_mb, 256, "The size at which a new log segment is "
+                                  "started");
+DEFINE_int32(log_queue_depth, 64, "The number of finished tests that wait to "
+                                  "be logged before new ones are dropped");
+DEFINE_string(log_fsync, "none", "When logs are synced to disk: 'none', "
+                                 "'file' after every file, or 'batch' once "
+                                 "for all the tests logged together");
+DEFINE_string(clock, "system", "The clock for timestamps and pacing: "
+                               "'system' or 'tsc'");
 
 namespace {
 bool ValidatePort(const char* flagname, int32_t value) {
@@ -38,157 +60,97 @@ bool ValidatePort(const char* flagname, int32_t value) {
   std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
   return false;
 }
-}  // namespace
 
-DEFINE_validator(port, ValidatePort);
+bool ValidateNonNegative(const char* flagname, int32_t value) {
+  if (value >= 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
 
-namespace mbm {
-bool used_port[NUM_PORTS];
-uint16_t next_port = 0;
-pthread_mutex_t used_port_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-struct ServerConfig {
-  // Takes ownership of the control socket.
-  ServerConfig( const mlab::AcceptedSocket* ctrl_socket)
-      : ctrl_socket(ctrl_socket) {}
-  ~ServerConfig() {
-    delete ctrl_socket;
-  }
+bool ValidateQueueWait(const char* flagname, int32_t value) {
+  // Past the client's timeout a queued test can't start anyway.
+  if (value >= 0 && value < DEFAULT_TIMEO_SEC * MS_PER_SEC)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
 
-  const mlab::AcceptedSocket* ctrl_socket;
-};
-
-uint16_t GetAvailablePort() {
-  // TODO: This could be smarter - maintain a set of unused ports, eg., and
-  // pick the first.
-  uint16_t mbm_port = 0;
-  for (; mbm_port < NUM_PORTS; ++mbm_port) {
-    if (!used_port[next_port % NUM_PORTS])
-      break;
-    next_port = (next_port + 1) % NUM_PORTS;
-  }
-  assert(mbm_port != NUM_PORTS);
-  return next_port++;
+bool ValidateSharedPort(const char* flagname, int32_t value) {
+  if (value >= 0 && value < 65536)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+bool ValidateNumPorts(const char* flagname, int32_t value) {
+  if (value > 0 && value < 65536)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+bool ValidatePrefix(const char* flagname, const std::string& value) {
+  boost::system::error_code ec;
+  if (boost::filesystem::is_directory(value, ec))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
 }
 
+bool ValidateLogFormat(const char* flagname, const std::string& value) {
+  if (value == "binary" || value == "text")
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+bool ValidateLogStore(const char* flagname, const std::string& value) {
+  mbm::LogStore store;
+  if (mbm::ParseLogStore(value, &store))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+
+bool ValidatePositive(const char* flagname, int32_t value) {
+  if (value > 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
 
-void* ServerThread(void* server_config_data) {
-  scoped_ptr<ServerConfig> server_config(
-      reinterpret_cast<ServerConfig*>(server_config_data));
-
-  // Pick a port.
-  pthread_mutex_lock(&used_port_mutex);
-  uint16_t available_port = GetAvailablePort();
-  used_port[available_port] = true;
-  pthread_mutex_unlock(&used_port_mutex);
-
-  uint16_t port = available_port + BASE_PORT;
-
-  // control-flow loop, break when error occurs. (exception is probably better)
-  do {
-    const mlab::AcceptedSocket* ctrl_socket = server_config->ctrl_socket;
-    // set send and receive timeout for ctrl socket
-    timeval timeout = {5, 0};
-    if (setsockopt(ctrl_socket->raw(), SOL_SOCKET, SO_RCVTIMEO, 
-                   (const char*) &timeout, sizeof(timeout))
-        == -1) {
-      std::cout << "failed to set receive timeout" << std::endl;
-      break;
-    }
-    if (setsockopt(ctrl_socket->raw(), SOL_SOCKET, SO_SNDTIMEO, 
-                   (const char*) &timeout, sizeof(timeout))
-        == -1) {
-      std::cout << "failed to set send timeout" << std::endl;
-      break;
-    }
-
-    std::cout << "Getting config\n";
-    ssize_t num_bytes;
-    mlab::Packet config_buff = ctrl_socket->Receive(sizeof(Config), &num_bytes);
-    if (num_bytes < 0 || static_cast<unsigned>(num_bytes) < sizeof(Config) ) {
-      std::cout << "failed to receive config" << std::endl;
-      break;
-    }
-    const Config config = config_buff.as<Config>();
-
-    std::cout << "Setting config [" << config.socket_type << " | "
-              << config.cbr_kb_s << " kb/s | " << config.rtt_ms << " ms | "
-              << config.mss_bytes << " bytes" << " ]\n";
-
-
-    // create listen socket, if error occurs pick another port
-    // if error occurs more than 3 times terminate the test
-    mlab::ListenSocket* listen_socket = NULL;
-    for (int count = 0; count < NUM_PORTS_TO_TRY; ++count) {
-      listen_socket = mlab::ListenSocket::Create(port, config.socket_type);
-      if (listen_socket) break;
-
-      uint16_t current = available_port;
-      pthread_mutex_lock(&used_port_mutex);
-      available_port = GetAvailablePort();
-      used_port[current] = false;
-      used_port[available_port] = true;
-      pthread_mutex_unlock(&used_port_mutex);
-      port = available_port + BASE_PORT;
-    }
-    if (!listen_socket) {
-      std::cout << "failed to create listen socket" << std::endl;
-      break;
-    }
-    scoped_ptr<mlab::ListenSocket> mbm_socket(listen_socket);
-
-    std::cout << "Listening on " << port << "\n";
-
-    // Let the client know that they can connect.
-    std::cout << "Telling client to connect on port " << port << "\n";
-    if (!ctrl_socket->Send(mlab::Packet(htons(port)), &num_bytes)) {
-      std::cout << "failed to send port" << std::endl;
-      break;
-    }
-
-    mlab::AcceptedSocket* test_socket_buff = mbm_socket->Accept();
-    if (!test_socket_buff) {
-      std::cout << "failed to accept test connection" << std::endl;
-      break;
-    }
-
-    scoped_ptr<mlab::AcceptedSocket> test_socket(test_socket_buff);
-    if (setsockopt(test_socket->raw(), SOL_SOCKET, SO_RCVTIMEO, 
-                   (const char*) &timeout, sizeof(timeout))
-        == -1) {
-      std::cout << "failed to set receive timeout" << std::endl;
-      break;
-    }
-    if (setsockopt(test_socket->raw(), SOL_SOCKET, SO_SNDTIMEO, 
-                   (const char*) &timeout, sizeof(timeout))
-        == -1) {
-      std::cout << "failed to set send timeout" << std::endl;
-      break;
-    }
-
-    std::cout << "Waiting for READY\n";
-    std::string ctrl_ready = ctrl_socket->Receive(strlen(READY), &num_bytes).str();
-    std::string test_ready = test_socket->Receive(strlen(READY), &num_bytes).str();
-    if (ctrl_ready != READY || test_ready != READY) {
-      std::cout << "failed to receive ready" << std::endl;
-      break;
-    }
-    if (!ctrl_socket->Send(mlab::Packet(READY, strlen(READY)), &num_bytes)) {
-      std::cout << "failed to send ready" << std::endl;
-      break;
-    }
-    
-    RunCBR(test_socket.get(), ctrl_socket, config);
-  } while(false);
-
-  pthread_mutex_lock(&used_port_mutex);
-  used_port[available_port] = false;
-  pthread_mutex_unlock(&used_port_mutex);
-
-  pthread_exit(NULL);
+bool ValidateFsync(const char* flagname, const std::string& value) {
+  mbm::FsyncPolicy policy;
+  if (mbm::ParseFsyncPolicy(value, &policy))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+bool ValidateClock(const char* flagname, const std::string& value) {
+  mbm::ClockSource source;
+  if (mbm::ParseClockSource(value, &source))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
 }
+}  // namespace
 
-}  // namespace mbm
+DEFINE_validator(port, ValidatePort);
+DEFINE_validator(base_port, ValidatePort);
+DEFINE_validator(num_ports, ValidateNumPorts);
+DEFINE_validator(shared_test_port, ValidateSharedPort);
+DEFINE_validator(workers, ValidateNonNegative);
+DEFINE_validator(max_queued_tests, ValidateNonNegative);
+DEFINE_validator(max_queue_wait_ms, ValidateQueueWait);
+DEFINE_validator(stats_interval_sec, ValidateNonNegative);
+DEFINE_validator(prefix, ValidatePrefix);
+DEFINE_validator(log_format, ValidateLogFormat);
+DEFINE_validator(log_store, ValidateLogStore);
+DEFINE_validator(log_segment_mb, ValidatePositive);
+DEFINE_validator(log_queue_depth, ValidatePositive);
+DEFINE_validator(log_fsync, ValidateFsync);
+DEFINE_validator(clock, ValidateClock);
 
 int main(int argc, char* argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
@@ -200,35 +162,62 @@ int main(int argc, char* argv[]) {
   if (FLAGS_verbose)
     mlab::SetLogSeverity(mlab::VERBOSE);
   gflags::SetVersionString(MBM_VERSION);
-  srand(time(NULL));
+  ClockSource clock = CLOCK_SOURCE_SYSTEM;
+  ParseClockSource(FLAGS_clock, &clock);
+  if (SetClockSource(clock) != clock)
+    std::cout << "TSC clock not usable, using the system clock\n";
+  if (GetClockSource() == CLOCK_SOURCE_TSC) {
+    int64_t error_ns, max_error_ns;
+    GetClockError(&error_ns, &max_error_ns);
+    std::cout << "TSC clock calibrated, " << error_ns << " ns off\n";
+  }
 
-  for (int i = 0; i < NUM_PORTS; ++i)
-    used_port[i] = false;
+  // Clients can hang up at any point of the handshake; that shouldn't take
+  // the server down.
+  signal(SIGPIPE, SIG_IGN);
+
+  if (FLAGS_base_port + FLAGS_num_ports > 65536) {
+    std::cerr << "--base_port + --num_ports must be at most 65536\n";
+    return 1;
+  }
+  PortAllocator ports(FLAGS_base_port, FLAGS_num_ports);
+
+  // Declared before the workers so that it outlives the sessions that log
+  // through it.
+  LogStore log_store = LOG_STORE_FILES;
+  ParseLogStore(FLAGS_log_store, &log_store);
+  FsyncPolicy fsync_policy = FSYNC_NONE;
+  ParseFsyncPolicy(FLAGS_log_fsync, &fsync_policy);
+  LogWriter log_writer(FLAGS_prefix, FLAGS_log_format == "binary", log_store,
+                       static_cast<uint64_t>(FLAGS_log_segment_mb) << 20,
+                       FLAGS_log_queue_depth, fsync_policy);
+  if (!log_writer.Start())
+    return 1;
+
+  uint32_t num_workers = FLAGS_workers;
+  if (num_workers == 0)
+    num_workers = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  WorkerPool workers(num_workers, FLAGS_max_queued_tests,
+                     static_cast<uint64_t>(FLAGS_max_queue_wait_ms) * 1000000,
+                     FLAGS_pin_workers);
+  if (!workers.Start())
+    return 1;
 
   scoped_ptr<mlab::ListenSocket> socket(
       mlab::ListenSocket::CreateOrDie(FLAGS_port));
   std::cout << "Listening on port " << FLAGS_port << std::endl;
 
-  while (true) {
-    socket->Select();
-    std::cout << "New connection\n";
-    const mlab::AcceptedSocket* ctrl_socket(socket->Accept());
-    if (!ctrl_socket) continue;
-
-    ServerConfig* server_config =
-        new ServerConfig(ctrl_socket);
-
-    // Each server socket runs on a different thread.
-    pthread_t thread;
-    int rc = pthread_create(&thread, NULL, mbm::ServerThread,
-                            (void*)server_config);
-    if (rc != 0) {
-      std::cerr << "Failed to create thread: " << strerror(errno) << " ["
-                << errno << "]\n";
-      return 1;
-    }
-  }
-
-  pthread_exit(NULL);
+  scoped_ptr<mlab::ListenSocket> shared_socket(
+      FLAGS_shared_test_port == 0 ? NULL :
+      mlab::ListenSocket::CreateOrDie(FLAGS_shared_test_port));
+  if (FLAGS_shared_test_port != 0)
+    std::cout << "Shared test port " << FLAGS_shared_test_port << std::endl;
+
+  // Handshakes all run on this thread; tests run on the workers.
+  ControlReactor reactor(socket.get(), shared_socket.get(),
+                         FLAGS_shared_test_port, &ports, &workers,
+                         &log_writer, FLAGS_stats_interval_sec);
+  if (!reactor.Run())
+    return 1;
   return 0;
 }
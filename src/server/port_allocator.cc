@@ -0,0 +1,55 @@
+#include "server/port_allocator.h"
+
+namespace mbm {
+namespace {
+const uint32_t kBitsPerWord = 64;
+}  // namespace
+
+PortAllocator::PortAllocator(uint16_t base_port, uint32_t num_ports)
+    : base_port_(base_port),
+      num_ports_(num_ports),
+      next_port_(0),
+      used_((num_ports + kBitsPerWord - 1) / kBitsPerWord, 0) {
+  // Ports past the end of the range are marked used so nothing hands them
+  // out.
+  if (num_ports % kBitsPerWord != 0)
+    used_.back() = ~0ULL << (num_ports % kBitsPerWord);
+}
+
+bool PortAllocator::Acquire(uint16_t* port) {
+  const uint32_t num_words = used_.size();
+  const uint32_t start =
+      __atomic_fetch_add(&next_port_, 1, __ATOMIC_RELAXED) % num_ports_;
+  const uint64_t before_start = (1ULL << (start % kBitsPerWord)) - 1;
+  // The word start is in is looked at twice: from start on first, and the
+  // bits before start once every other word has been tried.
+  for (uint32_t i = 0; i <= num_words; ++i) {
+    const uint32_t index = (start / kBitsPerWord + i) % num_words;
+    uint64_t skip = 0;
+    if (i == 0)
+      skip = before_start;
+    else if (i == num_words)
+      skip = ~before_start;
+    uint64_t word = __atomic_load_n(&used_[index], __ATOMIC_RELAXED);
+    while ((word | skip) != ~0ULL) {
+      const uint32_t bit = __builtin_ctzll(~(word | skip));
+      // On failure word is reloaded, so the next free bit is looked up
+      // again.
+      if (__atomic_compare_exchange_n(&used_[index], &word,
+                                      word | (1ULL << bit), true,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        *port = base_port_ + index * kBitsPerWord + bit;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void PortAllocator::Release(uint16_t port) {
+  const uint32_t offset = port - base_port_;
+  __atomic_fetch_and(&used_[offset / kBitsPerWord],
+                     ~(1ULL << (offset % kBitsPerWord)), __ATOMIC_RELEASE);
+}
+
+}  // namespace mbm
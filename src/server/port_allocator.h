@@ -0,0 +1,33 @@
+#ifndef SERVER_PORT_ALLOCATOR_H
+#define SERVER_PORT_ALLOCATOR_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace mbm {
+
+// Hands out test ports in [base_port, base_port + num_ports). Safe to use
+// from any thread without locking: the ports in use are a bitmap, and a port
+// is taken by atomically setting its bit.
+class PortAllocator {
+  public:
+    PortAllocator(uint16_t base_port, uint32_t num_ports);
+    // Returns false if every port is taken.
+    bool Acquire(uint16_t* port);
+    void Release(uint16_t port);
+
+  private:
+    uint16_t base_port_;
+    uint32_t num_ports_;
+    // The port the next search starts from. Every Acquire moves it on by
+    // one, so ports are handed out round robin and a port that was just
+    // released only comes up again once the search has gone round the
+    // range.
+    uint32_t next_port_;
+    std::vector<uint64_t> used_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_PORT_ALLOCATOR_H
@@ -0,0 +1,260 @@
+#include "server/record_reader.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include "common/config.h"
+
+namespace mbm {
+namespace {
+// Bytes read per recv() call.
+const size_t kReadBytes = 64 * 1024;
+// Compact batches: count, encoded size and nonce checksum.
+const size_t kCompactHeaderBytes = 3 * sizeof(uint32_t);
+}  // namespace
+
+RecordReader::RecordReader(int fd, uint32_t features, uint32_t max_records,
+                           uint32_t settle_polls)
+    : fd_(fd),
+      streaming_((features & FEATURE_STREAM_RECORDS) != 0),
+      compact_((features & FEATURE_COMPACT_RECORDS) != 0),
+      finished_(false),
+      max_records_(max_records),
+      pending_offset_(0),
+      raw_batch_first_(0),
+      raw_bytes_left_(0),
+      scanned_(0),
+      seen_(max_records, false),
+      highest_(0),
+      settle_polls_(std::max(settle_polls, static_cast<uint32_t>(1))),
+      settled_(0),
+      settled_received_(0) {
+}
+
+bool RecordReader::Poll() {
+  while (!finished_) {
+    ssize_t num_bytes;
+    if (!Read(MSG_DONTWAIT, &num_bytes))
+      return false;
+    if (num_bytes == 0)
+      return true;
+    if (!Parse())
+      return false;
+  }
+  return true;
+}
+
+bool RecordReader::Finish() {
+  while (!finished_) {
+    ssize_t num_bytes;
+    if (!Read(0, &num_bytes))
+      return false;
+    if (num_bytes == 0) {
+      std::cerr << "timed out waiting for client data\n";
+      return false;
+    }
+    if (!Parse())
+      return false;
+  }
+  std::cout << "client data: " << records_.size() << " records" << std::endl;
+  return true;
+}
+
+bool RecordReader::Read(int flags, ssize_t* num_bytes) {
+  // The body of a raw batch goes straight into records_.
+  if (raw_bytes_left_ > 0) {
+    char* end = reinterpret_cast<char*>(&records_[0] + records_.size());
+    if (!Receive(end - raw_bytes_left_, raw_bytes_left_, flags, num_bytes))
+      return false;
+    raw_bytes_left_ -= *num_bytes;
+    if (raw_bytes_left_ == 0)
+      EndRawBatch();
+    return true;
+  }
+
+  // Drop what has been parsed before growing the buffer.
+  if (pending_offset_ > 0) {
+    pending_.erase(pending_.begin(), pending_.begin() + pending_offset_);
+    pending_offset_ = 0;
+  }
+  size_t old_size = pending_.size();
+  pending_.resize(old_size + kReadBytes);
+  bool ok = Receive(&pending_[old_size], kReadBytes, flags, num_bytes);
+  pending_.resize(old_size + *num_bytes);
+  return ok;
+}
+
+bool RecordReader::Receive(char* buffer, size_t size, int flags,
+                           ssize_t* num_bytes) {
+  ssize_t received;
+  do {
+    received = recv(fd_, buffer, size, flags);
+  } while (received < 0 && errno == EINTR);
+  *num_bytes = 0;
+  if (received < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return true;
+    std::cerr << "failed to read client data: " << strerror(errno) << "\n";
+    return false;
+  }
+  if (received == 0) {
+    std::cerr << "client closed the connection before sending its data\n";
+    return false;
+  }
+  *num_bytes = received;
+  return true;
+}
+
+bool RecordReader::CheckNonces(const SendRecords& sent) {
+  if (!compact_)
+    return true;
+  for (size_t b = 0; b < batches_.size(); ++b) {
+    size_t end = b + 1 < batches_.size() ? batches_[b + 1].first_record
+                                         : records_.size();
+    uint32_t checksum = kNonceChecksumSeed;
+    for (size_t i = batches_[b].first_record; i < end; ++i) {
+      uint32_t seq_no = records_[i].seq_no();
+      if (seq_no >= sent.size()) {
+        std::cerr << "client reported packet " << seq_no
+                  << " which was never sent\n";
+        return false;
+      }
+      uint32_t nonce = sent.nonce(seq_no);
+      records_[i] = TrafficData(seq_no, nonce, records_[i].timestamp());
+      checksum = UpdateNonceChecksum(checksum, nonce);
+    }
+    if (checksum != batches_[b].nonce_checksum) {
+      std::cerr << "client nonces don't match the ones sent\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+void RecordReader::Progress(uint32_t* expected, uint32_t* received) {
+  Scan();
+
+  // Everything seen settle_polls_ calls ago was below the oldest highest_.
+  if (highests_.size() == settle_polls_) {
+    for (; settled_ < highests_.front(); ++settled_) {
+      if (seen_[settled_])
+        ++settled_received_;
+    }
+    highests_.pop_front();
+  }
+  highests_.push_back(highest_);
+  *expected = settled_;
+  *received = settled_received_;
+}
+
+uint32_t RecordReader::Received(uint32_t sent) {
+  Scan();
+  uint32_t received = 0;
+  for (uint32_t seq_no = 0; seq_no < sent && seq_no < seen_.size(); ++seq_no) {
+    if (seen_[seq_no])
+      ++received;
+  }
+  return received;
+}
+
+void RecordReader::Scan() {
+  // A raw batch still being read is in network order.
+  size_t end = raw_bytes_left_ > 0 ? raw_batch_first_ : records_.size();
+  for (; scanned_ < end; ++scanned_) {
+    uint32_t seq_no = records_[scanned_].seq_no();
+    // Duplicates, and seq_nos that can't have been sent, would make the loss
+    // look smaller than it is.
+    if (seq_no >= seen_.size() || seen_[seq_no])
+      continue;
+    seen_[seq_no] = true;
+    highest_ = std::max(highest_, seq_no + 1);
+    if (seq_no < settled_)
+      ++settled_received_;
+  }
+}
+
+bool RecordReader::Parse() {
+  while (!finished_ && raw_bytes_left_ == 0 &&
+         pending_.size() - pending_offset_ >= sizeof(uint32_t)) {
+    uint32_t count;
+    memcpy(&count, &pending_[pending_offset_], sizeof(count));
+    count = ntohl(count);
+    if (count > max_records_ - records_.size()) {
+      std::cerr << "client sent more than " << max_records_ << " records\n";
+      return false;
+    }
+    if (!compact_) {
+      StartRawBatch(count);
+      continue;
+    }
+    bool complete;
+    if (!ParseCompact(count, &complete))
+      return false;
+    if (!complete)
+      return true;
+  }
+  return true;
+}
+
+void RecordReader::StartRawBatch(uint32_t count) {
+  // Whatever part of the batch is already buffered is copied over; Read()
+  // receives the rest in place.
+  pending_offset_ += sizeof(count);
+  raw_batch_first_ = records_.size();
+  records_.resize(records_.size() + count);
+  size_t batch_bytes = count * sizeof(TrafficData);
+  size_t buffered = std::min(batch_bytes, pending_.size() - pending_offset_);
+  if (buffered > 0) {
+    memcpy(&records_[raw_batch_first_], &pending_[pending_offset_], buffered);
+    pending_offset_ += buffered;
+  }
+  raw_bytes_left_ = batch_bytes - buffered;
+  if (raw_bytes_left_ == 0)
+    EndRawBatch();
+}
+
+void RecordReader::EndRawBatch() {
+  size_t count = records_.size() - raw_batch_first_;
+  if (count > 0)
+    TrafficData::ntoh(&records_[raw_batch_first_], count);
+  if (!streaming_ || count == 0)
+    finished_ = true;
+}
+
+bool RecordReader::ParseCompact(uint32_t count, bool* complete) {
+  *complete = false;
+  if (pending_.size() - pending_offset_ < kCompactHeaderBytes)
+    return true;
+  uint32_t header[3];
+  memcpy(header, &pending_[pending_offset_], sizeof(header));
+  uint32_t encoded_bytes = ntohl(header[1]);
+  if (encoded_bytes > static_cast<uint64_t>(count) * kMaxEncodedRecordBytes) {
+    std::cerr << "client sent a malformed batch of records\n";
+    return false;
+  }
+  size_t batch_bytes = kCompactHeaderBytes + encoded_bytes;
+  if (pending_.size() - pending_offset_ < batch_bytes)
+    return true;
+
+  Batch batch = {records_.size(), ntohl(header[2])};
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(
+      &pending_[pending_offset_ + kCompactHeaderBytes]);
+  if (!decoder_.Decode(data, encoded_bytes, count, &records_)) {
+    std::cerr << "client sent a malformed batch of records\n";
+    return false;
+  }
+  if (count > 0)
+    batches_.push_back(batch);
+  pending_offset_ += batch_bytes;
+  if (!streaming_ || count == 0)
+    finished_ = true;
+  *complete = true;
+  return true;
+}
+
+}  // namespace mbm
@@ -0,0 +1,106 @@
+#ifndef SERVER_RECORD_READER_H
+#define SERVER_RECORD_READER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <vector>
+
+#include "common/record_codec.h"
+#include "common/traffic_data.h"
+#include "server/send_records.h"
+
+namespace mbm {
+
+// Reads the client's receive records off the control socket. They come in
+// batches: a 32-bit record count followed by that many records. Without
+// streaming the client sends one batch after END; with streaming it sends
+// them as the test runs and ends with an empty batch. Compact batches put the
+// encoded size and the nonce checksum after the count (see record_codec.h).
+class RecordReader {
+  public:
+    // features are the ones the client asked for. Refuses more than
+    // max_records in total. Progress() gives a missing packet settle_polls
+    // calls to turn up before it counts as lost.
+    RecordReader(int fd, uint32_t features, uint32_t max_records,
+                 uint32_t settle_polls);
+    // Takes whatever has arrived without blocking. Returns false if the
+    // client hung up or broke the framing.
+    bool Poll();
+    // Blocks until the last batch is in, up to the socket's receive timeout
+    // for each read.
+    bool Finish();
+    // Compact batches don't carry nonces: fills them in from the ones the
+    // server sent and checks them against each batch's checksum. Does
+    // nothing for raw batches.
+    bool CheckNonces(const SendRecords& sent);
+    const std::vector<TrafficData>& records() const { return records_; }
+    // Hands the records over, leaving the reader with none.
+    void MoveRecordsTo(std::vector<TrafficData>* records) {
+      records->clear();
+      records->swap(records_);
+    }
+    // Loss so far, for deciding a test early: *expected packets should have
+    // arrived and *received of them have, each seq_no counted once. A packet
+    // is only expected once a later one was received settle_polls calls ago,
+    // so reordered packets have that many poll intervals to turn up before
+    // they count as lost. Ones that turn up later still count as received.
+    void Progress(uint32_t* expected, uint32_t* received);
+    // How many of the packets numbered below sent were received, each seq_no
+    // counted once, as Progress() does. Call it after Finish() for the loss
+    // of the whole test.
+    uint32_t Received(uint32_t sent);
+
+  private:
+    // One recv(), into pending_ or, in the middle of a raw batch, straight
+    // into records_. EAGAIN counts as nothing read.
+    bool Read(int flags, ssize_t* num_bytes);
+    bool Receive(char* buffer, size_t size, int flags, ssize_t* num_bytes);
+    // Moves the complete batches in pending_ into records_.
+    bool Parse();
+    // Makes room for a raw batch of count records at the end of records_.
+    void StartRawBatch(uint32_t count);
+    // Byte swaps the raw batch in place once it has all arrived.
+    void EndRawBatch();
+    // Decodes the compact batch at the front of pending_. Sets *complete to
+    // false if it hasn't all arrived yet.
+    bool ParseCompact(uint32_t count, bool* complete);
+    // Marks the seq_nos of the records read since the last call in seen_.
+    void Scan();
+
+    struct Batch {
+      size_t first_record;
+      uint32_t nonce_checksum;
+    };
+
+    int fd_;
+    bool streaming_;
+    bool compact_;
+    bool finished_;
+    uint32_t max_records_;
+    std::vector<char> pending_;
+    size_t pending_offset_;
+    // Where the raw batch being read starts, and how much of it is missing.
+    size_t raw_batch_first_;
+    size_t raw_bytes_left_;
+    std::vector<TrafficData> records_;
+    RecordDecoder decoder_;
+    std::vector<Batch> batches_;
+
+    // Progress state: the records seen so far, which seq_nos they hold, one
+    // past the highest of them, and the seq_no below which packets are
+    // expected. highests_ holds highest_ as of the last settle_polls_ calls;
+    // the oldest is where settled_ moves next.
+    size_t scanned_;
+    std::vector<bool> seen_;
+    uint32_t highest_;
+    uint32_t settle_polls_;
+    std::deque<uint32_t> highests_;
+    uint32_t settled_;
+    uint32_t settled_received_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_RECORD_READER_H
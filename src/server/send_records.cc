@@ -0,0 +1,141 @@
+#include "server/send_records.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+namespace mbm {
+namespace {
+const uint32_t kChunkShift = 16;
+const uint32_t kChunkRecords = 1 << kChunkShift;
+const uint32_t kChunkMask = kChunkRecords - 1;
+const size_t kChunkBytes = kChunkRecords * sizeof(uint32_t);
+const uint64_t kMaxOffsetNs = std::numeric_limits<uint32_t>::max();
+// Bases are set a little before the timestamp that starts them, so that a
+// kernel timestamp taken just before the send call returned still fits.
+const uint64_t kBaseSlackNs = 10000000;
+// A base lasts at least four seconds; this covers tests of a few minutes.
+const size_t kExpectedBases = 128;
+// Chunks faulted in up front, a little under a second of records at 1Gbps.
+const size_t kPrefaultChunks = 2;
+}  // namespace
+
+uint32_t SendRecords::const_iterator::nonce() const {
+  return records_->nonce(seq_no_);
+}
+
+uint64_t SendRecords::const_iterator::timestamp() const {
+  return records_->bases_[base_].time_ns + *records_->offsets(seq_no_);
+}
+
+SendRecords::const_iterator& SendRecords::const_iterator::operator++() {
+  ++seq_no_;
+  if (base_ + 1 < records_->bases_.size() &&
+      seq_no_ >= records_->bases_[base_ + 1].first)
+    ++base_;
+  return *this;
+}
+
+SendRecords::const_iterator::const_iterator(const SendRecords* records,
+                                            uint32_t seq_no)
+    : records_(records),
+      seq_no_(seq_no),
+      base_(seq_no < records->size() ? records->FindBase(seq_no) : 0) {}
+
+SendRecords::SendRecords(uint32_t expected, const NonceSequence& nonces)
+    : nonces_(nonces), size_(0) {
+  chunks_.reserve((static_cast<size_t>(expected) + kChunkMask) >> kChunkShift);
+  while (chunks_.size() < kPrefaultChunks &&
+         chunks_.size() * kChunkRecords < expected)
+    AddChunk();
+  bases_.reserve(kExpectedBases);
+}
+
+SendRecords::~SendRecords() {
+  for (size_t i = 0; i < chunks_.size(); ++i)
+    munmap(chunks_[i], kChunkBytes);
+}
+
+void SendRecords::Append(uint64_t timestamp) {
+  if ((size_ >> kChunkShift) == chunks_.size())
+    AddChunk();
+  // Half way through the last chunk there is, fault in the next one.
+  if ((size_ & kChunkMask) == kChunkRecords / 2 &&
+      (size_ >> kChunkShift) + 1 == chunks_.size())
+    AddChunk();
+  if (bases_.empty() || timestamp < bases_.back().time_ns ||
+      timestamp - bases_.back().time_ns > kMaxOffsetNs) {
+    Base base;
+    base.first = size_;
+    base.time_ns = timestamp > kBaseSlackNs ? timestamp - kBaseSlackNs : 0;
+    bases_.push_back(base);
+  }
+  *offsets(size_) = static_cast<uint32_t>(timestamp - bases_.back().time_ns);
+  ++size_;
+}
+
+bool SendRecords::SetTimestamp(uint32_t seq_no, uint64_t timestamp) {
+  if (seq_no >= size_)
+    return false;
+  const Base& base = bases_[FindBase(seq_no)];
+  if (timestamp < base.time_ns || timestamp - base.time_ns > kMaxOffsetNs)
+    return false;
+  *offsets(seq_no) = static_cast<uint32_t>(timestamp - base.time_ns);
+  return true;
+}
+
+uint64_t SendRecords::timestamp(uint32_t seq_no) const {
+  return bases_[FindBase(seq_no)].time_ns + *offsets(seq_no);
+}
+
+size_t SendRecords::allocated_bytes() const {
+  return chunks_.size() * kChunkBytes + bases_.capacity() * sizeof(Base);
+}
+
+void SendRecords::swap(SendRecords& other) {
+  std::swap(nonces_, other.nonces_);
+  chunks_.swap(other.chunks_);
+  bases_.swap(other.bases_);
+  std::swap(size_, other.size_);
+}
+
+void SendRecords::AddChunk() {
+  int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;
+#endif
+  void* chunk = mmap(NULL, kChunkBytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (chunk == MAP_FAILED) {
+    // Like running out of memory in a vector.
+    std::cerr << "failed to allocate send records: " << strerror(errno)
+              << "\n";
+    abort();
+  }
+#ifndef MAP_POPULATE
+  memset(chunk, 0, kChunkBytes);
+#endif
+  chunks_.push_back(static_cast<uint32_t*>(chunk));
+}
+
+size_t SendRecords::FindBase(uint32_t seq_no) const {
+  // Most lookups are for recent records.
+  if (seq_no >= bases_.back().first)
+    return bases_.size() - 1;
+  return std::upper_bound(bases_.begin(), bases_.end(), seq_no,
+                          &SendRecords::BeforeBase) - bases_.begin() - 1;
+}
+
+bool SendRecords::BeforeBase(uint32_t seq_no, const Base& base) {
+  return seq_no < base.first;
+}
+
+uint32_t* SendRecords::offsets(uint32_t seq_no) const {
+  return chunks_[seq_no >> kChunkShift] + (seq_no & kChunkMask);
+}
+
+}  // namespace mbm
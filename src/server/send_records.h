@@ -0,0 +1,90 @@
+#ifndef SERVER_SEND_RECORDS_H
+#define SERVER_SEND_RECORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "common/nonce.h"
+
+namespace mbm {
+
+// The nonce and departure time of every chunk a generator sent, by seq_no.
+// Nonces come from the test's NonceSequence and aren't stored. Timestamps
+// are kept as 32-bit nanosecond offsets from a base time, with a new base
+// whenever one doesn't fit (every few seconds), in fixed size chunks of
+// memory. Each chunk is faulted in while the one before it is half full, so
+// recording a chunk in the pacing loop never touches a new page, yet a test
+// that ends early only holds the memory it used. Nothing is ever copied to
+// grow, and a record takes 4 bytes rather than 12.
+class SendRecords {
+  public:
+    class const_iterator {
+      public:
+        uint32_t seq_no() const { return seq_no_; }
+        uint32_t nonce() const;
+        uint64_t timestamp() const;
+        const_iterator& operator++();
+        bool operator==(const const_iterator& other) const {
+          return seq_no_ == other.seq_no_;
+        }
+        bool operator!=(const const_iterator& other) const {
+          return seq_no_ != other.seq_no_;
+        }
+
+      private:
+        friend class SendRecords;
+        const_iterator(const SendRecords* records, uint32_t seq_no);
+
+        const SendRecords* records_;
+        uint32_t seq_no_;
+        // The base seq_no_ is in.
+        size_t base_;
+    };
+
+    // Faults in the first chunks and makes room to track the chunks of
+    // expected records. More can be added either way.
+    SendRecords(uint32_t expected, const NonceSequence& nonces);
+    ~SendRecords();
+
+    // Records the next chunk.
+    void Append(uint64_t timestamp);
+    // Replaces the timestamp of an earlier record. Returns false, leaving the
+    // old one, if it's too far from the record's base.
+    bool SetTimestamp(uint32_t seq_no, uint64_t timestamp);
+
+    uint32_t size() const { return size_; }
+    uint32_t nonce(uint32_t seq_no) const { return nonces_.nonce(seq_no); }
+    uint64_t timestamp(uint32_t seq_no) const;
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, size_); }
+    // The memory held, whether it's used yet or not.
+    size_t allocated_bytes() const;
+    // Trades records with other without copying any.
+    void swap(SendRecords& other);
+
+  private:
+    SendRecords(const SendRecords&);
+    SendRecords& operator=(const SendRecords&);
+
+    // Timestamps of records from first on are offsets from time_ns.
+    struct Base {
+      uint32_t first;
+      uint64_t time_ns;
+    };
+
+    void AddChunk();
+    size_t FindBase(uint32_t seq_no) const;
+    static bool BeforeBase(uint32_t seq_no, const Base& base);
+    uint32_t* offsets(uint32_t seq_no) const;
+
+    NonceSequence nonces_;
+    std::vector<uint32_t*> chunks_;
+    std::vector<Base> bases_;
+    uint32_t size_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_SEND_RECORDS_H
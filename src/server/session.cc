@@ -0,0 +1,45 @@
+#include "server/session.h"
+
+#include <arpa/inet.h>
+
+#include "mlab/accepted_socket.h"
+#include "mlab/listen_socket.h"
+#include "server/cbr.h"
+#include "server/port_allocator.h"
+
+namespace mbm {
+
+Session::Session(const mlab::AcceptedSocket* ctrl_socket, PortAllocator* ports,
+                 LogWriter* log_writer)
+    : ctrl_socket(ctrl_socket),
+      listen_socket(NULL),
+      test_socket(NULL),
+      ports(ports),
+      log_writer(log_writer),
+      port(0),
+      hello(false) {
+}
+
+Session::~Session() {
+  delete test_socket;
+  delete listen_socket;
+  delete ctrl_socket;
+  if (port != 0)
+    ports->Release(port);
+}
+
+void RunSession(Session* session) {
+  RunCBR(session->test_socket, session->ctrl_socket, session->config,
+         session->log_writer);
+  delete session;
+}
+
+void RejectSession(Session* session) {
+  // Older clients only see the connection close.
+  ssize_t num_bytes;
+  if (session->hello)
+    session->ctrl_socket->Send(mlab::Packet(htonl(0)), &num_bytes);
+  delete session;
+}
+
+}  // namespace mbm
@@ -0,0 +1,45 @@
+#ifndef SERVER_SESSION_H
+#define SERVER_SESSION_H
+
+#include <stdint.h>
+
+#include "common/config.h"
+
+namespace mlab {
+class AcceptedSocket;
+class ListenSocket;
+}  // namespace mlab
+
+namespace mbm {
+class LogWriter;
+class PortAllocator;
+
+// Everything a test needs once the control handshake is done. Owns the
+// sockets and gives the test port back when it goes away.
+struct Session {
+  // Takes ownership of the control socket.
+  Session(const mlab::AcceptedSocket* ctrl_socket, PortAllocator* ports,
+          LogWriter* log_writer);
+  ~Session();
+
+  const mlab::AcceptedSocket* ctrl_socket;
+  const mlab::ListenSocket* listen_socket;
+  const mlab::AcceptedSocket* test_socket;
+  PortAllocator* ports;
+  LogWriter* log_writer;
+  // 0 until a test port has been acquired.
+  uint16_t port;
+  Config config;
+  // Whether the client sent a hello, and so understands a rejection.
+  bool hello;
+};
+
+// Runs the test and deletes the session.
+void RunSession(Session* session);
+// Tells a client that already has READY that its test won't run, with a
+// chunk length of 0 if it understands that, and deletes the session.
+void RejectSession(Session* session);
+
+}  // namespace mbm
+
+#endif  // SERVER_SESSION_H
@@ -0,0 +1,265 @@
+#include "server/tcp_stats.h"
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifndef OS_FREEBSD
+#include <linux/sockios.h>
+#endif
+
+#include <algorithm>
+#include <iostream>
+
+#include "common/constants.h"
+#include "common/time.h"
+#include "mlab/socket.h"
+#ifdef USE_WEB100
+#include "server/web100.h"
+#endif  // USE_WEB100
+
+namespace mbm {
+namespace {
+#ifdef USE_WEB100
+// The web100 kernel patch exports its connections here.
+const char kWeb100Proc[] = "/proc/web100";
+#endif  // USE_WEB100
+// Draining takes a few rtts at most; a few checks per rtt is plenty, within
+// these bounds.
+const uint64_t kMinDrainSleepNs = NS_PER_SEC / MS_PER_SEC;
+const uint64_t kMaxDrainSleepNs = 100 * (NS_PER_SEC / MS_PER_SEC);
+}  // namespace
+
+bool ParseTcpStatsSource(const std::string& value, TcpStatsSource* source) {
+  if (value == "none")
+    *source = TCP_STATS_NONE;
+  else if (value == "auto")
+    *source = TCP_STATS_AUTO;
+  else if (value == "web100")
+    *source = TCP_STATS_WEB100;
+  else if (value == "tcp_info")
+    *source = TCP_STATS_TCP_INFO;
+  else
+    return false;
+  return true;
+}
+
+const char* TcpStatsSourceName(TcpStatsSource source) {
+  switch (source) {
+    case TCP_STATS_AUTO:
+      return "auto";
+    case TCP_STATS_WEB100:
+      return "web100";
+    case TCP_STATS_TCP_INFO:
+      return "tcp_info";
+    default:
+      return "none";
+  }
+}
+
+TcpStats::TcpStats(const mlab::Socket* socket, TcpStatsSource source)
+    : socket_(socket),
+      source_(TCP_STATS_NONE) {
+  memset(&start_, 0, sizeof(start_));
+  memset(&last_, 0, sizeof(last_));
+#ifdef USE_WEB100
+  agent_ = NULL;
+  connection_ = NULL;
+#endif  // USE_WEB100
+  if (socket->type() != SOCKETTYPE_TCP)
+    return;
+
+  if (source == TCP_STATS_WEB100 || source == TCP_STATS_AUTO) {
+#ifdef USE_WEB100
+    if (access(kWeb100Proc, F_OK) == 0) {
+      agent_ = new web100::Agent;
+      connection_ = new web100::Connection(socket, agent_->get());
+      source_ = TCP_STATS_WEB100;
+      return;
+    }
+#endif  // USE_WEB100
+    if (source == TCP_STATS_WEB100) {
+      std::cerr << "web100 is not available\n";
+      return;
+    }
+  }
+
+  if (source == TCP_STATS_TCP_INFO || source == TCP_STATS_AUTO) {
+    Snapshot snapshot;
+    if (ReadTcpInfo(&snapshot))
+      source_ = TCP_STATS_TCP_INFO;
+  }
+}
+
+TcpStats::~TcpStats() {
+#ifdef USE_WEB100
+  delete connection_;
+  delete agent_;
+#endif  // USE_WEB100
+}
+
+void TcpStats::Start() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100) {
+    connection_->Start();
+    return;
+  }
+#endif  // USE_WEB100
+  if (source_ == TCP_STATS_TCP_INFO && ReadTcpInfo(&start_))
+    last_ = start_;
+}
+
+void TcpStats::Stop() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100) {
+    connection_->Stop();
+    return;
+  }
+#endif  // USE_WEB100
+  if (source_ == TCP_STATS_TCP_INFO)
+    ReadTcpInfo(&last_);
+}
+
+uint32_t TcpStats::PacketRetransCount() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->PacketRetransCount();
+#endif  // USE_WEB100
+  return last_.retrans - start_.retrans;
+}
+
+uint32_t TcpStats::RetransmitQueueSize() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->RetransmitQueueSize();
+#endif  // USE_WEB100
+  return last_.unacked_bytes;
+}
+
+uint32_t TcpStats::ApplicationWriteQueueSize() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->ApplicationWriteQueueSize();
+#endif  // USE_WEB100
+  return last_.unsent_bytes;
+}
+
+uint32_t TcpStats::SampleRTT() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->SampleRTT();
+#endif  // USE_WEB100
+  return last_.rtt_ms;
+}
+
+uint32_t TcpStats::CurCwnd() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->CurCwnd();
+#endif  // USE_WEB100
+  return last_.cwnd_bytes;
+}
+
+uint32_t TcpStats::SndUna() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->SndUna();
+#endif  // USE_WEB100
+  return 0;
+}
+
+uint32_t TcpStats::SndNxt() {
+#ifdef USE_WEB100
+  if (source_ == TCP_STATS_WEB100)
+    return connection_->SndNxt();
+#endif  // USE_WEB100
+  return last_.unacked_bytes;
+}
+
+bool TcpStats::WaitForDrain(uint32_t max_in_flight, uint64_t deadline_ns) {
+  if (source_ == TCP_STATS_NONE)
+    return true;
+  WaitForUnsent(deadline_ns);
+  while (true) {
+    Stop();
+    if (SndNxt() - SndUna() < max_in_flight)
+      return true;
+    uint64_t now = GetTimeNS();
+    if (now >= deadline_ns)
+      return false;
+    uint64_t sleep_ns = static_cast<uint64_t>(SampleRTT()) *
+                        (NS_PER_SEC / MS_PER_SEC) / 4;
+    sleep_ns = std::min(std::max(sleep_ns, kMinDrainSleepNs),
+                        kMaxDrainSleepNs);
+    sleep_ns = std::min(sleep_ns, deadline_ns - now);
+    NanoSleepX(sleep_ns / NS_PER_SEC, sleep_ns % NS_PER_SEC);
+  }
+}
+
+void TcpStats::WaitForUnsent(uint64_t deadline_ns) {
+#ifdef TCP_NOTSENT_LOWAT
+  // With a low water mark of 1 the socket is only writable once nothing is
+  // left unsent.
+  const int fd = socket_->raw();
+  int old_lowat;
+  socklen_t lowat_len = sizeof(old_lowat);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &old_lowat,
+                 &lowat_len) != 0)
+    return;
+  int lowat = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat,
+                 sizeof(lowat)) != 0)
+    return;
+  while (true) {
+    uint64_t now = GetTimeNS();
+    if (now >= deadline_ns)
+      break;
+    pollfd writable = {fd, POLLOUT, 0};
+    int timeout_ms = static_cast<int>(std::min(
+        (deadline_ns - now) / (NS_PER_SEC / MS_PER_SEC) + 1,
+        static_cast<uint64_t>(MS_PER_SEC)));
+    int ready = poll(&writable, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready != 0)
+      break;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &old_lowat,
+             sizeof(old_lowat));
+#endif  // TCP_NOTSENT_LOWAT
+}
+
+bool TcpStats::ReadTcpInfo(Snapshot* snapshot) {
+#ifndef OS_FREEBSD
+  tcp_info info;
+  socklen_t info_len = sizeof(info);
+  if (getsockopt(socket_->raw(), IPPROTO_TCP, TCP_INFO, &info,
+                 &info_len) != 0) {
+    std::cerr << "failed to read TCP_INFO: " << strerror(errno) << "\n";
+    return false;
+  }
+  // Everything in the queue, and the part of it not sent yet.
+  int queued_bytes = 0;
+  int unsent_bytes = 0;
+  if (ioctl(socket_->raw(), SIOCOUTQ, &queued_bytes) != 0 ||
+      ioctl(socket_->raw(), SIOCOUTQNSD, &unsent_bytes) != 0) {
+    std::cerr << "failed to read the send queue: " << strerror(errno) << "\n";
+    return false;
+  }
+  snapshot->retrans = info.tcpi_total_retrans;
+  snapshot->unacked_bytes = queued_bytes - unsent_bytes;
+  snapshot->unsent_bytes = unsent_bytes;
+  // Smoothed, in us; TCP_INFO doesn't keep the last sample.
+  snapshot->rtt_ms = info.tcpi_rtt / 1000;
+  snapshot->cwnd_bytes = info.tcpi_snd_cwnd * info.tcpi_snd_mss;
+  return true;
+#else
+  return false;
+#endif  // OS_FREEBSD
+}
+
+}  // namespace mbm
@@ -0,0 +1,95 @@
+#ifndef SERVER_TCP_STATS_H
+#define SERVER_TCP_STATS_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace mlab {
+class Socket;
+}  // namespace mlab
+
+#ifdef USE_WEB100
+namespace web100 {
+class Agent;
+class Connection;
+}  // namespace web100
+#endif  // USE_WEB100
+
+namespace mbm {
+
+enum TcpStatsSource {
+  TCP_STATS_NONE,
+  // web100 if the server was built with it and the kernel has it, TCP_INFO
+  // otherwise.
+  TCP_STATS_AUTO,
+  // Needs a web100 kernel.
+  TCP_STATS_WEB100,
+  // getsockopt(TCP_INFO) and the SIOCOUTQ ioctls, on any Linux kernel.
+  TCP_STATS_TCP_INFO
+};
+
+// Parses "none", "auto", "web100" or "tcp_info". Returns false for anything
+// else.
+bool ParseTcpStatsSource(const std::string& value, TcpStatsSource* source);
+const char* TcpStatsSourceName(TcpStatsSource source);
+
+// Transport statistics of a TCP test connection, with the interface of
+// web100::Connection: Start() sets the baseline for the retransmit count,
+// and Stop() takes the snapshot every other call reads. Stop() can be
+// called again for a newer snapshot. Sizes are in bytes and the RTT in ms.
+class TcpStats {
+  public:
+    TcpStats(const mlab::Socket* socket, TcpStatsSource source);
+    ~TcpStats();
+    // What the statistics come from. TCP_STATS_NONE if no source works, and
+    // then every call returns 0.
+    TcpStatsSource source() const { return source_; }
+
+    void Start();
+    void Stop();
+    uint32_t PacketRetransCount();
+    uint32_t RetransmitQueueSize();
+    uint32_t ApplicationWriteQueueSize();
+    uint32_t SampleRTT();
+    uint32_t CurCwnd();
+    // TCP_INFO has no sequence numbers: there SndUna() is 0 and SndNxt() the
+    // bytes in flight. Only the difference means the same for every source.
+    uint32_t SndUna();
+    uint32_t SndNxt();
+
+    // Blocks until fewer than max_in_flight bytes are sent but unacked, as
+    // of a new snapshot, or until deadline_ns (GetTimeNS() time). Unsent
+    // data is waited out in poll() with TCP_NOTSENT_LOWAT, and the rest with
+    // sleeps of a fraction of the rtt. Returns false on the deadline.
+    bool WaitForDrain(uint32_t max_in_flight, uint64_t deadline_ns);
+
+  private:
+    TcpStats(const TcpStats&);
+    TcpStats& operator=(const TcpStats&);
+
+    struct Snapshot {
+      uint32_t retrans;
+      uint32_t unacked_bytes;
+      uint32_t unsent_bytes;
+      uint32_t rtt_ms;
+      uint32_t cwnd_bytes;
+    };
+
+    bool ReadTcpInfo(Snapshot* snapshot);
+    // Blocks in poll() until everything written has been sent.
+    void WaitForUnsent(uint64_t deadline_ns);
+
+    const mlab::Socket* socket_;
+    TcpStatsSource source_;
+    Snapshot start_;
+    Snapshot last_;
+#ifdef USE_WEB100
+    web100::Agent* agent_;
+    web100::Connection* connection_;
+#endif  // USE_WEB100
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_TCP_STATS_H
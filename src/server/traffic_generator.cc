@@ -1,16 +1,30 @@
 #include "server/traffic_generator.h"
 
+#include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#ifndef OS_FREEBSD
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
 #include <vector>
 
 #include "mlab/accepted_socket.h"
 #include "mlab/packet.h"
 #include "common/constants.h"
 #include "common/time.h"
+#include "common/timestamping.h"
 #include "gflags/gflags.h"
 
 #ifdef USE_WEB100
@@ -18,8 +32,64 @@
 #endif  // !USE_WEB100
 
 DECLARE_bool(verbose);
+DEFINE_bool(sendmmsg, true, "Send each UDP burst with a single sendmmsg call");
+DEFINE_bool(udp_gso, false, "Let the kernel segment UDP bursts (UDP_SEGMENT) "
+                            "when the socket supports it");
+DEFINE_bool(tcp_coalesce, true, "Write each TCP burst with a single call");
+DEFINE_bool(tcp_zerocopy, false, "Send coalesced TCP bursts with MSG_ZEROCOPY "
+                                 "when the socket supports it");
+DEFINE_uint64(nonce_seed, 0, "Secret mixed into every test's random nonce "
+                             "seed, so that seeds can't be guessed even if "
+                             "/dev/urandom can't be read");
+DEFINE_string(tx_timestamps, "none", "Log the kernel's send timestamps: "
+                                     "'none', 'software' or 'hardware'");
+
+namespace {
+bool ValidateTimestamps(const char* flagname, const std::string& value) {
+  mbm::TimestampingMode mode;
+  if (mbm::ParseTimestampingMode(value, &mode))
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << std::endl;
+  return false;
+}
+
+const bool tx_timestamps_validator =
+    gflags::RegisterFlagValidator(&FLAGS_tx_timestamps, &ValidateTimestamps);
+}  // namespace
 
 namespace mbm {
+namespace {
+// seq_no and nonce at the start of every chunk.
+const uint32_t kHeaderBytes = 2 * sizeof(uint32_t);
+// Limits of a single UDP_SEGMENT send: UDP_MAX_SEGMENTS in the kernel, and
+// the whole super-datagram has to fit in one IP packet.
+const uint32_t kMaxSegments = 64;
+const uint32_t kMaxSegmentBytes = 65000;
+// IP and UDP headers in front of every segment.
+const uint32_t kIPv4UdpHeaderBytes = 20 + 8;
+const uint32_t kIPv6UdpHeaderBytes = 40 + 8;
+// Burst buffers in flight with MSG_ZEROCOPY, and how long to wait for the
+// kernel to release one.
+const uint32_t kZerocopyBuffers = 4;
+const int kZerocopyTimeoutMs = DEFAULT_TIMEO_SEC * MS_PER_SEC;
+// Error queue messages read per recvmmsg call.
+const uint32_t kErrorQueueBatch = 64;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && !defined(OS_FREEBSD)
+#define HAVE_ZEROCOPY
+#endif
+#if defined(SO_TXTIME) && !defined(OS_FREEBSD)
+#define HAVE_TXTIME
+#endif
+
+// SCM_TXTIME launch times are taken against CLOCK_MONOTONIC, which is what
+// fq compares them with.
+uint64_t GetMonotonicTimeNS() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return static_cast<uint64_t>(time.tv_sec) * NS_PER_SEC + time.tv_nsec;
+}
+}  // namespace
 
 TrafficGenerator::TrafficGenerator(const mlab::AcceptedSocket *test_socket,
                                    uint32_t bytes_per_chunk, uint32_t max_pkt)
@@ -29,18 +99,161 @@ TrafficGenerator::TrafficGenerator(const mlab::AcceptedSocket *test_socket,
       total_bytes_sent_(0),
       packets_sent_(0),
       last_percent_(0),
-      buffer_(std::vector<char>(bytes_per_chunk,'x')) {
-  nonce_.reserve(max_pkt);
-  timestamps_.reserve(max_pkt);
+      batch_(FLAGS_sendmmsg && test_socket->type() == SOCKETTYPE_UDP &&
+             bytes_per_chunk >= kHeaderBytes),
+      segment_(false),
+      coalesce_(FLAGS_tcp_coalesce && test_socket->type() == SOCKETTYPE_TCP &&
+                bytes_per_chunk >= kHeaderBytes),
+      zerocopy_(false),
+      paced_(false),
+      txtime_(false),
+      tx_timestamps_(false),
+      tx_clock_fd_(-1),
+      kernel_timestamps_(0),
+      hardware_timestamps_(0),
+      buffer_(std::vector<char>(bytes_per_chunk,'x')),
+      nonces_(TestSeed(FLAGS_nonce_seed)),
+      records_(max_pkt, nonces_),
+      txtime_origin_ns_(0),
+      txtime_ns_per_chunk_(0),
+      txtime_first_packet_(0),
+      segment_chunks_(0),
+      next_burst_buffer_(0),
+      zerocopy_sent_(0),
+      zerocopy_done_(0) {
+  // A segmented burst would only get one timestamp, so timestamping wins.
+  TimestampingMode timestamping = TIMESTAMPING_NONE;
+  ParseTimestampingMode(FLAGS_tx_timestamps, &timestamping);
+  // For TCP the kernel numbers timestamps by byte from here on, so this has
+  // to come before anything is written to the socket.
+  if (timestamping != TIMESTAMPING_NONE)
+    tx_timestamps_ = EnableTimestamping(test_socket->raw(), timestamping, true);
+  if (tx_timestamps_ && timestamping == TIMESTAMPING_HARDWARE) {
+    tx_clock_fd_ = OpenHardwareClock(test_socket->raw());
+    if (tx_clock_fd_ < 0)
+      std::cout << "No hardware clock found, using software timestamps\n";
+  }
+  if (FLAGS_udp_gso && !tx_timestamps_ &&
+      test_socket->type() == SOCKETTYPE_UDP && bytes_per_chunk >= kHeaderBytes)
+    segment_ = EnableSegmentation();
+  if (coalesce_ && FLAGS_tcp_zerocopy)
+    zerocopy_ = EnableZerocopy();
+  if (coalesce_) {
+    burst_buffers_.resize(zerocopy_ ? kZerocopyBuffers : 1);
+    burst_release_id_.resize(burst_buffers_.size(), 0);
+  }
+}
+
+TrafficGenerator::~TrafficGenerator() {
+  if (tx_clock_fd_ >= 0)
+    close(tx_clock_fd_);
 }
 
 bool TrafficGenerator::Send(uint32_t num_chunks, ssize_t& num_bytes){
+  bool sent;
+  if (segment_ && num_chunks > 1)
+    sent = SendSegmented(num_chunks, num_bytes);
+  else if (coalesce_)
+    sent = SendCoalesced(num_chunks, num_bytes);
+  else if (batch_)
+    sent = SendBatch(num_chunks, num_bytes);
+  else
+    sent = SendChunks(num_chunks, num_bytes);
+
+  // This burst's timestamps are mostly still on their way; earlier ones
+  // aren't.
+  if (tx_timestamps_)
+    ReadErrorQueue();
+  return sent;
+}
+
+void TrafficGenerator::CollectTimestamps() {
+  if (tx_timestamps_)
+    ReadErrorQueue();
+}
+
+bool TrafficGenerator::EnableKernelPacing(uint64_t bytes_per_sec,
+                                          uint64_t ns_per_chunk) {
+  switch (test_socket_->type()) {
+    case SOCKETTYPE_TCP: {
+#ifdef SO_MAX_PACING_RATE
+      uint32_t rate = std::min(
+          bytes_per_sec,
+          static_cast<uint64_t>(std::numeric_limits<uint32_t>::max() - 1));
+      if (setsockopt(test_socket_->raw(), SOL_SOCKET, SO_MAX_PACING_RATE,
+                     &rate, sizeof(rate)) == 0) {
+        paced_ = true;
+        txtime_ns_per_chunk_ = ns_per_chunk;
+        txtime_origin_ns_ = 0;
+        txtime_first_packet_ = packets_sent_;
+        return true;
+      }
+      std::cout << "Socket does not support SO_MAX_PACING_RATE: "
+                << strerror(errno) << "\n";
+#endif  // SO_MAX_PACING_RATE
+      return false;
+    }
+
+    case SOCKETTYPE_UDP: {
+#ifdef HAVE_TXTIME
+      if (bytes_per_chunk_ < kHeaderBytes)
+        return false;
+      sock_txtime txtime;
+      txtime.clockid = CLOCK_MONOTONIC;
+      txtime.flags = 0;
+      if (setsockopt(test_socket_->raw(), SOL_SOCKET, SO_TXTIME,
+                     &txtime, sizeof(txtime)) != 0) {
+        std::cout << "Socket does not support SO_TXTIME: " << strerror(errno)
+                  << "\n";
+        return false;
+      }
+      // Without IP_RECVERR the kernel hides a datagram fq dropped, and it
+      // would count as lost on the path.
+      int domain = AF_INET;
+      socklen_t domain_len = sizeof(domain);
+      getsockopt(test_socket_->raw(), SOL_SOCKET, SO_DOMAIN, &domain,
+                 &domain_len);
+      int one = 1;
+      int recverr = domain == AF_INET6 ?
+          setsockopt(test_socket_->raw(), SOL_IPV6, IPV6_RECVERR,
+                     &one, sizeof(one)) :
+          setsockopt(test_socket_->raw(), SOL_IP, IP_RECVERR,
+                     &one, sizeof(one));
+      if (recverr != 0) {
+        std::cout << "Socket does not support IP_RECVERR: " << strerror(errno)
+                  << "\n";
+        return false;
+      }
+      // Launch times are per datagram, so only the sendmmsg path carries
+      // them; a segmented burst would leave back to back.
+      if (segment_)
+        DisableSegmentation();
+      batch_ = true;
+      paced_ = true;
+      txtime_ = true;
+      txtime_ns_per_chunk_ = ns_per_chunk;
+      txtime_origin_ns_ = 0;
+      txtime_first_packet_ = packets_sent_;
+      msgs_.clear();
+      return true;
+#else
+      return false;
+#endif  // HAVE_TXTIME
+    }
+
+    default:
+      return false;
+  }
+}
+
+bool TrafficGenerator::SendChunks(uint32_t num_chunks, ssize_t& num_bytes){
   num_bytes = 0;
   ssize_t local_num_bytes;
+  const int64_t launch_offset_ns = LaunchOffset();
   for(uint32_t i=0; i<num_chunks; ++i){
     uint32_t seq_no = htonl(packets_sent_);
     memcpy(&buffer_[0], &seq_no, sizeof(packets_sent_));
-    uint32_t nonce = htonl(rand());
+    uint32_t nonce = htonl(nonces_.nonce(packets_sent_));
     memcpy(&buffer_[0]+sizeof(packets_sent_), &nonce, sizeof(nonce));
 
 
@@ -51,32 +264,437 @@ bool TrafficGenerator::Send(uint32_t num_chunks, ssize_t& num_bytes){
       return false;
     }
 
-    nonce_.push_back(ntohl(nonce));
-    timestamps_.push_back(GetTimeNS());
-
     num_bytes += chunk_packet.length();
-    ++packets_sent_;
-
-    if (FLAGS_verbose) {
-      std::cout << "  s: " << std::hex << ntohl(seq_no) << " " << std::dec
-                << ntohl(seq_no) << "\n";
-      std::cout << "  nonce: " << std::hex << ntohl(nonce) << " " << std::dec
-                << ntohl(nonce) << "\n";
-      if (max_packets_ != 0) {
-        uint32_t percent = static_cast<uint32_t>(
-            static_cast<float>(100 * packets_sent_) / max_packets_);
-        if (percent > last_percent_) {
-          last_percent_ = percent;
-          std::cout << "\r" << percent << "%" << std::flush;
-        }
-      }
-    }
+    Sent(DepartureTime(GetTimeNS(), launch_offset_ns));
   } // for loop
   total_bytes_sent_ += num_bytes;
   
   return (static_cast<unsigned>(num_bytes) == num_chunks * bytes_per_chunk_);
 }
 
+bool TrafficGenerator::SendBatch(uint32_t num_chunks, ssize_t& num_bytes) {
+  num_bytes = 0;
+  if (msgs_.size() < num_chunks)
+    ReserveBatch(num_chunks);
+
+  // Write the headers for the whole burst up front so the send loop below is
+  // nothing but syscalls.
+  for (uint32_t i = 0; i < num_chunks; ++i) {
+    headers_[2 * i] = htonl(packets_sent_ + i);
+    headers_[2 * i + 1] = htonl(nonces_.nonce(packets_sent_ + i));
+  }
+  const int64_t launch_offset_ns = LaunchOffset();
+#ifdef HAVE_TXTIME
+  if (txtime_) {
+    for (uint32_t i = 0; i < num_chunks; ++i) {
+      uint64_t launch_ns = LaunchTime(packets_sent_ + i);
+      memcpy(CMSG_DATA(CMSG_FIRSTHDR(&msgs_[i].msg_hdr)), &launch_ns,
+             sizeof(launch_ns));
+    }
+  }
+#endif  // HAVE_TXTIME
+
+  uint32_t done = 0;
+  while (done < num_chunks) {
+    int sent = sendmmsg(test_socket_->raw(), &msgs_[done], num_chunks - done,
+                        0);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS && txtime_) {
+        std::cerr << "fq dropped a datagram, its flow queue is full: raise "
+                  << "its flow_limit or lower --kernel_pacing_queue_pkt\n";
+      } else {
+        std::cerr << "sendmmsg failed: " << strerror(errno) << "\n";
+      }
+      total_bytes_sent_ += num_bytes;
+      num_bytes = -1;
+      return false;
+    }
+    // Every datagram of one call leaves the socket at the same time, unless
+    // fq holds it back until its launch time.
+    uint64_t timestamp = GetTimeNS();
+    for (int i = 0; i < sent; ++i, ++done) {
+      num_bytes += msgs_[done].msg_len;
+      Sent(DepartureTime(timestamp, launch_offset_ns));
+    }
+  }
+  total_bytes_sent_ += num_bytes;
+
+  return (static_cast<unsigned>(num_bytes) == num_chunks * bytes_per_chunk_);
+}
+
+bool TrafficGenerator::SendSegmented(uint32_t num_chunks, ssize_t& num_bytes) {
+  num_bytes = 0;
+  uint32_t done = 0;
+  while (done < num_chunks) {
+    uint32_t count = std::min(num_chunks - done, segment_chunks_);
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t header[2] = {htonl(packets_sent_ + i),
+                            htonl(nonces_.nonce(packets_sent_ + i))};
+      memcpy(&segment_buffer_[i * bytes_per_chunk_], header, kHeaderBytes);
+    }
+
+    ssize_t sent = send(test_socket_->raw(), &segment_buffer_[0],
+                        count * bytes_per_chunk_, 0);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && (errno == EIO || errno == EINVAL)) {
+      // The egress device can't checksum segments for us, or the path MTU
+      // dropped below a segment. Nothing of this send went out; finish the
+      // burst, and the rest of the test, without segmentation, where the
+      // kernel fragments datagrams that don't fit.
+      std::cout << "UDP_SEGMENT refused (" << strerror(errno)
+                << "), disabling\n";
+      DisableSegmentation();
+      total_bytes_sent_ += num_bytes;
+      ssize_t rest_bytes;
+      bool ok = Send(num_chunks - done, rest_bytes);
+      if (rest_bytes < 0) {
+        num_bytes = -1;
+        return false;
+      }
+      num_bytes += rest_bytes;
+      return ok;
+    }
+    if (sent < 0) {
+      std::cerr << "send failed: " << strerror(errno) << "\n";
+      total_bytes_sent_ += num_bytes;
+      num_bytes = -1;
+      return false;
+    }
+
+    uint64_t timestamp = GetTimeNS();
+    for (uint32_t i = 0; i < count; ++i)
+      Sent(timestamp);
+    num_bytes += sent;
+    done += count;
+  }
+  total_bytes_sent_ += num_bytes;
+
+  return (static_cast<unsigned>(num_bytes) == num_chunks * bytes_per_chunk_);
+}
+
+bool TrafficGenerator::EnableSegmentation() {
+#ifdef UDP_SEGMENT
+  // Segments can't be fragmented: every one has to fit the path MTU.
+  int domain = AF_INET;
+  socklen_t domain_len = sizeof(domain);
+  getsockopt(test_socket_->raw(), SOL_SOCKET, SO_DOMAIN, &domain,
+             &domain_len);
+  int mtu = 0;
+  socklen_t mtu_len = sizeof(mtu);
+  int got_mtu = domain == AF_INET6 ?
+      getsockopt(test_socket_->raw(), SOL_IPV6, IPV6_MTU, &mtu, &mtu_len) :
+      getsockopt(test_socket_->raw(), SOL_IP, IP_MTU, &mtu, &mtu_len);
+  if (got_mtu != 0) {
+    std::cout << "Can't get the path MTU: " << strerror(errno)
+              << ". Sending one datagram at a time.\n";
+    return false;
+  }
+  const uint32_t header_bytes = domain == AF_INET6 ? kIPv6UdpHeaderBytes
+                                                   : kIPv4UdpHeaderBytes;
+  if (bytes_per_chunk_ + header_bytes > static_cast<uint32_t>(mtu)) {
+    std::cout << "Chunks of " << bytes_per_chunk_ << " bytes don't fit the "
+              << "path MTU of " << mtu << ". Sending one datagram at a "
+              << "time.\n";
+    return false;
+  }
+
+  int segment_size = bytes_per_chunk_;
+  if (setsockopt(test_socket_->raw(), IPPROTO_UDP, UDP_SEGMENT,
+                 &segment_size, sizeof(segment_size)) != 0) {
+    std::cout << "Socket does not support UDP_SEGMENT: " << strerror(errno)
+              << ". Sending one datagram at a time.\n";
+    return false;
+  }
+  segment_chunks_ = std::min(kMaxSegments,
+                             std::max(kMaxSegmentBytes / bytes_per_chunk_, 1u));
+  segment_buffer_.assign(segment_chunks_ * bytes_per_chunk_, 'x');
+  return true;
+#else
+  return false;
+#endif  // UDP_SEGMENT
+}
+
+void TrafficGenerator::DisableSegmentation() {
+#ifdef UDP_SEGMENT
+  int segment_size = 0;
+  setsockopt(test_socket_->raw(), IPPROTO_UDP, UDP_SEGMENT,
+             &segment_size, sizeof(segment_size));
+#endif  // UDP_SEGMENT
+  segment_ = false;
+}
+
+bool TrafficGenerator::SendCoalesced(uint32_t num_chunks, ssize_t& num_bytes) {
+  num_bytes = 0;
+  std::vector<char>& burst = burst_buffers_[next_burst_buffer_];
+  if (zerocopy_ && !ReapZerocopy(burst_release_id_[next_burst_buffer_])) {
+    num_bytes = -1;
+    return false;
+  }
+
+  const size_t burst_bytes = num_chunks * bytes_per_chunk_;
+  if (burst.size() < burst_bytes)
+    burst.assign(burst_bytes, 'x');
+  for (uint32_t i = 0; i < num_chunks; ++i) {
+    uint32_t header[2] = {htonl(packets_sent_ + i),
+                          htonl(nonces_.nonce(packets_sent_ + i))};
+    memcpy(&burst[i * bytes_per_chunk_], header, kHeaderBytes);
+  }
+
+  // A short write still leaves whole chunks behind it; those get the
+  // timestamp of the call that finished them.
+  const int64_t launch_offset_ns = LaunchOffset();
+  size_t offset = 0;
+  uint32_t done = 0;
+  while (offset < burst_bytes) {
+    iovec iov = {&burst[offset], burst_bytes - offset};
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    int flags = 0;
+#ifdef HAVE_ZEROCOPY
+    if (zerocopy_)
+      flags = MSG_ZEROCOPY;
+#endif
+    ssize_t sent = sendmsg(test_socket_->raw(), &msg, flags);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS && zerocopy_) {
+        // Out of option memory for notifications; let some drain.
+        if (ReapZerocopy(zerocopy_sent_))
+          continue;
+      }
+      std::cerr << "sendmsg failed: " << strerror(errno) << "\n";
+      total_bytes_sent_ += num_bytes;
+      num_bytes = -1;
+      return false;
+    }
+    if (zerocopy_)
+      ++zerocopy_sent_;
+    offset += sent;
+    num_bytes += sent;
+
+    uint64_t timestamp = GetTimeNS();
+    for (; done < num_chunks && (done + 1) * bytes_per_chunk_ <= offset;
+         ++done)
+      Sent(DepartureTime(timestamp, launch_offset_ns));
+  }
+  total_bytes_sent_ += num_bytes;
+
+  burst_release_id_[next_burst_buffer_] = zerocopy_sent_;
+  next_burst_buffer_ = (next_burst_buffer_ + 1) % burst_buffers_.size();
+
+  return (static_cast<unsigned>(num_bytes) == burst_bytes);
+}
+
+bool TrafficGenerator::EnableZerocopy() {
+#ifdef HAVE_ZEROCOPY
+  int one = 1;
+  if (setsockopt(test_socket_->raw(), SOL_SOCKET, SO_ZEROCOPY,
+                 &one, sizeof(one)) == 0)
+    return true;
+  std::cout << "Socket does not support SO_ZEROCOPY: " << strerror(errno)
+            << ". Copying TCP bursts.\n";
+#endif  // HAVE_ZEROCOPY
+  return false;
+}
+
+bool TrafficGenerator::ReapZerocopy(uint32_t id) {
+#ifdef HAVE_ZEROCOPY
+  // ids wrap around, so compare the distance rather than the values.
+  while (static_cast<int32_t>(zerocopy_done_ - id) < 0) {
+    if (!ReadErrorQueue())
+      return false;
+    if (static_cast<int32_t>(zerocopy_done_ - id) >= 0)
+      break;
+
+    // Nothing queued yet. POLLERR fires when a completion arrives, but also
+    // on a socket error, which would otherwise spin here.
+    pollfd pfd = {test_socket_->raw(), 0, 0};
+    int ready = poll(&pfd, 1, kZerocopyTimeoutMs);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0) {
+      std::cerr << "timed out waiting for zerocopy completions\n";
+      return false;
+    }
+    int so_error = 0;
+    socklen_t so_error_len = sizeof(so_error);
+    if (getsockopt(test_socket_->raw(), SOL_SOCKET, SO_ERROR,
+                   &so_error, &so_error_len) == 0 && so_error != 0) {
+      std::cerr << "socket error while waiting for zerocopy completions: "
+                << strerror(so_error) << "\n";
+      return false;
+    }
+  }
+#endif  // HAVE_ZEROCOPY
+  return true;
+}
+
+bool TrafficGenerator::ReadErrorQueue() {
+#ifndef OS_FREEBSD
+  const size_t control_bytes = TimestampingControlBytes();
+  if (errqueue_msgs_.empty()) {
+    errqueue_control_.resize(kErrorQueueBatch * control_bytes);
+    errqueue_msgs_.resize(kErrorQueueBatch);
+  }
+
+  while (true) {
+    // The kernel shrinks msg_controllen to what it used.
+    for (uint32_t i = 0; i < kErrorQueueBatch; ++i) {
+      memset(&errqueue_msgs_[i], 0, sizeof(errqueue_msgs_[i]));
+      errqueue_msgs_[i].msg_hdr.msg_control =
+          &errqueue_control_[i * control_bytes];
+      errqueue_msgs_[i].msg_hdr.msg_controllen = control_bytes;
+    }
+    int received = recvmmsg(test_socket_->raw(), &errqueue_msgs_[0],
+                            kErrorQueueBatch, MSG_ERRQUEUE | MSG_DONTWAIT,
+                            NULL);
+    if (received < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      std::cerr << "failed to read the error queue: " << strerror(errno)
+                << "\n";
+      return false;
+    }
+
+    int64_t realtime_offset_ns = tx_timestamps_ ? GetRealtimeOffsetNS() : 0;
+    int64_t hardware_offset_ns;
+    const bool hardware =
+        tx_clock_fd_ >= 0 &&
+        GetHardwareOffsetNS(tx_clock_fd_, &hardware_offset_ns);
+    for (int i = 0; i < received; ++i) {
+      msghdr* msg = &errqueue_msgs_[i].msg_hdr;
+      for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+            !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+          continue;
+        sock_extended_err err;
+        memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+        if (err.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+          // TCP completes sends in order, and [ee_info, ee_data] is the
+          // range this notification covers.
+          zerocopy_done_ = err.ee_data + 1;
+        } else if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+          // ee_data counts datagrams for UDP and bytes for TCP, where it's
+          // the last byte of the send call. The byte count wraps every 4GiB,
+          // so it's taken as the latest byte with those low bits that has
+          // been written: every write is whole chunks, but the last one may
+          // be part way through when this runs.
+          uint32_t index = err.ee_data;
+          if (test_socket_->type() == SOCKETTYPE_TCP) {
+            const uint64_t last_byte =
+                (static_cast<uint64_t>(packets_sent_) + 1) * bytes_per_chunk_ -
+                1;
+            const uint32_t behind =
+                static_cast<uint32_t>(last_byte) - err.ee_data;
+            if (behind > last_byte)
+              continue;
+            const uint64_t byte = last_byte - behind;
+            if (byte / bytes_per_chunk_ >= packets_sent_)
+              continue;
+            index = static_cast<uint32_t>(byte / bytes_per_chunk_);
+          }
+          bool hardware_used;
+          uint64_t timestamp = GetTimestamp(
+              msg, realtime_offset_ns, hardware ? &hardware_offset_ns : NULL,
+              &hardware_used);
+          if (timestamp != 0 && records_.SetTimestamp(index, timestamp)) {
+            ++kernel_timestamps_;
+            if (hardware_used)
+              ++hardware_timestamps_;
+          }
+        }
+      }
+    }
+    if (static_cast<uint32_t>(received) < kErrorQueueBatch)
+      return true;
+  }
+#else
+  return true;
+#endif  // OS_FREEBSD
+}
+
+void TrafficGenerator::ReserveBatch(uint32_t num_chunks) {
+  headers_.resize(2 * num_chunks);
+  iovecs_.resize(2 * num_chunks);
+  msgs_.resize(num_chunks);
+  const size_t control_bytes = CMSG_SPACE(sizeof(uint64_t));
+  if (txtime_)
+    control_.assign(num_chunks * control_bytes, 0);
+  // Resizing moves the buffers, so every pointer is rebuilt.
+  for (uint32_t i = 0; i < num_chunks; ++i) {
+    iovecs_[2 * i].iov_base = &headers_[2 * i];
+    iovecs_[2 * i].iov_len = kHeaderBytes;
+    iovecs_[2 * i + 1].iov_base = &buffer_[kHeaderBytes];
+    iovecs_[2 * i + 1].iov_len = bytes_per_chunk_ - kHeaderBytes;
+    memset(&msgs_[i], 0, sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_iov = &iovecs_[2 * i];
+    msgs_[i].msg_hdr.msg_iovlen = 2;
+#ifdef HAVE_TXTIME
+    if (txtime_) {
+      msgs_[i].msg_hdr.msg_control = &control_[i * control_bytes];
+      msgs_[i].msg_hdr.msg_controllen = control_bytes;
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs_[i].msg_hdr);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    }
+#endif  // HAVE_TXTIME
+  }
+}
+
+uint64_t TrafficGenerator::LaunchTime(uint32_t seq_no) const {
+  return txtime_origin_ns_ +
+         txtime_ns_per_chunk_ * (seq_no - txtime_first_packet_);
+}
+
+int64_t TrafficGenerator::LaunchOffset() {
+  if (!paced_)
+    return 0;
+  if (txtime_origin_ns_ == 0)
+    txtime_origin_ns_ = GetMonotonicTimeNS();
+  return static_cast<int64_t>(GetTimeNS()) -
+         static_cast<int64_t>(GetMonotonicTimeNS());
+}
+
+uint64_t TrafficGenerator::DepartureTime(uint64_t timestamp,
+                                         int64_t launch_offset_ns) const {
+  if (!paced_)
+    return timestamp;
+  return std::max(LaunchTime(packets_sent_) + launch_offset_ns, timestamp);
+}
+
+void TrafficGenerator::Sent(uint64_t timestamp) {
+  records_.Append(timestamp);
+
+  if (FLAGS_verbose) {
+    std::cout << "  s: " << std::hex << packets_sent_ << " " << std::dec
+              << packets_sent_ << "\n";
+    uint32_t nonce = records_.nonce(packets_sent_);
+    std::cout << "  nonce: " << std::hex << nonce << " " << std::dec
+              << nonce << "\n";
+  }
+  ++packets_sent_;
+
+  if (FLAGS_verbose && max_packets_ != 0) {
+    uint32_t percent = static_cast<uint32_t>(
+        static_cast<float>(100 * packets_sent_) / max_packets_);
+    if (percent > last_percent_) {
+      last_percent_ = percent;
+      std::cout << "\r" << percent << "%" << std::flush;
+    }
+  }
+}
+
 bool TrafficGenerator::Send(uint32_t num_chunks) {
   ssize_t num_bytes;
   return Send(num_chunks, num_bytes);
@@ -95,12 +713,26 @@ uint32_t TrafficGenerator::bytes_per_chunk(){
 }
 
 
-const std::vector<uint32_t>& TrafficGenerator::nonce() {
-  return nonce_;
+const SendRecords& TrafficGenerator::records() {
+  return records_;
+}
+
+uint64_t TrafficGenerator::nonce_seed() {
+  return nonces_.seed();
+}
+
+void TrafficGenerator::MoveRecordsTo(SendRecords* records) {
+  records->swap(records_);
+  SendRecords none(0, nonces_);
+  records_.swap(none);
+}
+
+uint32_t TrafficGenerator::kernel_timestamps() {
+  return kernel_timestamps_;
 }
 
-const std::vector<uint64_t>& TrafficGenerator::timestamps() {
-  return timestamps_;
+uint32_t TrafficGenerator::hardware_timestamps() {
+  return hardware_timestamps_;
 }
 
 } // namespace mbm
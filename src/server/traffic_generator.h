@@ -1,37 +1,148 @@
 #ifndef SERVER_TRAFFIC_GENERATOR
 #define SERVER_TRAFFIC_GENERATOR
 
+#include <sys/socket.h>
+
 #include <vector>
 
 #include "mlab/accepted_socket.h"
+#include "common/nonce.h"
+#include "server/send_records.h"
 
 namespace mbm {
 
-class TrafficGenerator {  
+class TrafficGenerator {
   public:
     TrafficGenerator(const mlab::AcceptedSocket *test_socket,
                      uint32_t bytes_per_chunk, uint32_t max_pkt);
+    ~TrafficGenerator();
     bool Send(uint32_t num_chunks, ssize_t& num_bytes);
     bool Send(uint32_t num_chunks);
+    // Hands departure times to the kernel: every UDP chunk carries its own
+    // SCM_TXTIME launch time, spaced ns_per_chunk apart from the first chunk
+    // sent after this call, and TCP is capped with SO_MAX_PACING_RATE. The
+    // caller can then queue ahead of the schedule. Chunks are recorded with
+    // their scheduled departure rather than the time the send call returned,
+    // unless the call returned later; for TCP that schedule is only what the
+    // pacing rate allows. UDP needs the fq qdisc on the egress device, and
+    // fq dropping a datagram fails the send with ENOBUFS. Returns false if
+    // the socket doesn't support it.
+    bool EnableKernelPacing(uint64_t bytes_per_sec, uint64_t ns_per_chunk);
+    // With --tx_timestamps, replaces the timestamps taken after each send
+    // call with the kernel's as they come in. Send() picks them up in batches
+    // as it goes; call this once more after the last Send(). The kernel
+    // stamps every UDP datagram, but only the last byte of each TCP write, so
+    // coalesced TCP bursts keep the send call's time for all but their last
+    // chunk.
+    void CollectTimestamps();
+    // How many records have a kernel timestamp, and how many of those came
+    // from the device.
+    uint32_t kernel_timestamps();
+    uint32_t hardware_timestamps();
     uint32_t packets_sent();
     uint64_t total_bytes_sent();
     uint32_t bytes_per_chunk();
-    const std::vector<uint32_t>& nonce();
-    const std::vector<uint64_t>& timestamps();
+    const SendRecords& records();
+    // Hands the records over, leaving the generator with none. Call it once
+    // sending is done.
+    void MoveRecordsTo(SendRecords* records);
+    // Regenerates every nonce of the test, see NonceSequence.
+    uint64_t nonce_seed();
 
   private:
+    TrafficGenerator(const TrafficGenerator&);
+    TrafficGenerator& operator=(const TrafficGenerator&);
+
+    // One send call per chunk.
+    bool SendChunks(uint32_t num_chunks, ssize_t& num_bytes);
+    // UDP only: the whole burst goes out in as few sendmmsg calls as the
+    // kernel allows.
+    bool SendBatch(uint32_t num_chunks, ssize_t& num_bytes);
+    // UDP only: bursts are written into one buffer and the kernel cuts it
+    // into bytes_per_chunk datagrams (UDP_SEGMENT). Only enabled when a chunk
+    // fits the path MTU, and falls back to the other paths if the device
+    // refuses to segment or the MTU shrinks.
+    bool SendSegmented(uint32_t num_chunks, ssize_t& num_bytes);
+    bool EnableSegmentation();
+    void DisableSegmentation();
+    // TCP only: the burst is laid out in one buffer, chunk after chunk, and
+    // written with a single call, optionally with MSG_ZEROCOPY.
+    bool SendCoalesced(uint32_t num_chunks, ssize_t& num_bytes);
+    bool EnableZerocopy();
+    // Reads completions off the error queue until every zerocopy send up to,
+    // but not including, id is done.
+    bool ReapZerocopy(uint32_t id);
+    // Reads everything waiting on the error queue, zerocopy completions and
+    // send timestamps alike, without blocking.
+    bool ReadErrorQueue();
+    // Grows the sendmmsg headers so that a burst of num_chunks fits.
+    void ReserveBatch(uint32_t num_chunks);
+    // With paced_, the CLOCK_MONOTONIC time seq_no is scheduled to leave.
+    uint64_t LaunchTime(uint32_t seq_no) const;
+    // With paced_, starts the schedule on the first call and returns how far
+    // GetTimeNS() is ahead of CLOCK_MONOTONIC, for DepartureTime().
+    int64_t LaunchOffset();
+    // The time to record the next chunk with, given the time its send call
+    // returned: with paced_, the later of that and its launch time.
+    uint64_t DepartureTime(uint64_t timestamp, int64_t launch_offset_ns) const;
+    // Records the next chunk, which has left the socket.
+    void Sent(uint64_t timestamp);
+
     const mlab::AcceptedSocket *test_socket_;
     uint32_t max_packets_;
     uint32_t bytes_per_chunk_;
     uint64_t total_bytes_sent_;
     uint32_t packets_sent_;
     uint32_t last_percent_;
+    bool batch_;
+    bool segment_;
+    bool coalesce_;
+    bool zerocopy_;
+    // The kernel paces the traffic: SO_TXTIME for UDP, where txtime_ is set
+    // too, or SO_MAX_PACING_RATE for TCP.
+    bool paced_;
+    bool txtime_;
+    bool tx_timestamps_;
+    // With tx_timestamps_, the device clock hardware timestamps are on, or -1
+    // to use software ones only.
+    int tx_clock_fd_;
+    uint32_t kernel_timestamps_;
+    uint32_t hardware_timestamps_;
     std::vector<char> buffer_;
-    std::vector<uint32_t> nonce_;
-    std::vector<uint64_t> timestamps_;
-    
+    NonceSequence nonces_;
+    SendRecords records_;
+
+    // sendmmsg state. headers_ holds the seq_no and nonce of each chunk of
+    // the burst in network order; the padding is shared from buffer_.
+    std::vector<uint32_t> headers_;
+    std::vector<iovec> iovecs_;
+    std::vector<mmsghdr> msgs_;
+    // With txtime_, one SCM_TXTIME control message per chunk of the burst.
+    std::vector<char> control_;
+    // With paced_, the schedule chunks leave on.
+    uint64_t txtime_origin_ns_;
+    uint64_t txtime_ns_per_chunk_;
+    uint32_t txtime_first_packet_;
+
+    // UDP_SEGMENT state. segment_buffer_ holds up to segment_chunks_ chunks
+    // back to back, padding already filled in.
+    uint32_t segment_chunks_;
+    std::vector<char> segment_buffer_;
+
+    // Coalesced TCP state. With zerocopy the kernel reads the buffers after
+    // sendmsg returns, so they rotate and a buffer is only rewritten once the
+    // send recorded in burst_release_id_ has completed.
+    std::vector<std::vector<char> > burst_buffers_;
+    std::vector<uint32_t> burst_release_id_;
+    uint32_t next_burst_buffer_;
+    uint32_t zerocopy_sent_;
+    uint32_t zerocopy_done_;
+
+    // Error queue reads, in batches.
+    std::vector<char> errqueue_control_;
+    std::vector<mmsghdr> errqueue_msgs_;
 };
 
 } // namespace mbm
 
-#endif // SERVER_TRAFFIC_GENERATOR 
+#endif // SERVER_TRAFFIC_GENERATOR
@@ -0,0 +1,212 @@
+#include "server/worker_pool.h"
+
+#include <sched.h>
+#include <string.h>
+
+#include <iostream>
+
+#include "common/constants.h"
+#include "common/time.h"
+#include "server/session.h"
+
+namespace mbm {
+
+WorkerPool::WorkerPool(uint32_t num_workers, uint32_t max_queued,
+                       uint64_t max_wait_ns, bool pin)
+    : max_queued_(max_queued),
+      max_wait_ns_(max_wait_ns),
+      pin_(pin),
+      stopping_(false),
+      workers_(num_workers),
+      rejected_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+
+  // Pin to the CPUs we're allowed on, in order, wrapping around if there
+  // are more workers than CPUs.
+  std::vector<int> cpus;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (pin_ && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &allowed))
+        cpus.push_back(cpu);
+    }
+  }
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    Worker& worker = workers_[i];
+    worker.pool = this;
+    worker.cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+    worker.started = false;
+    worker.busy = false;
+    worker.sessions_run = 0;
+    worker.busy_ns = 0;
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    if (workers_[i].started)
+      pthread_join(workers_[i].thread, NULL);
+  }
+  while (!queue_.empty()) {
+    delete queue_.front().session;
+    queue_.pop_front();
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool WorkerPool::Start() {
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    Worker& worker = workers_[i];
+    int rc = pthread_create(&worker.thread, NULL, WorkerThread, &worker);
+    if (rc != 0) {
+      std::cerr << "Failed to create thread: " << strerror(rc) << " ["
+                << rc << "]\n";
+      return false;
+    }
+    worker.started = true;
+
+    if (worker.cpu >= 0) {
+      cpu_set_t cpu;
+      CPU_ZERO(&cpu);
+      CPU_SET(worker.cpu, &cpu);
+      rc = pthread_setaffinity_np(worker.thread, sizeof(cpu), &cpu);
+      if (rc != 0) {
+        std::cerr << "Failed to pin worker " << i << " to cpu " << worker.cpu
+                  << ": " << strerror(rc) << "\n";
+        worker.cpu = -1;
+      }
+    }
+  }
+  std::cout << "Started " << workers_.size() << " workers"
+            << (pin_ ? ", pinned" : "") << std::endl;
+  return true;
+}
+
+bool WorkerPool::Submit(Session* session) {
+  pthread_mutex_lock(&mutex_);
+  if (SaturatedLocked()) {
+    ++rejected_;
+    pthread_mutex_unlock(&mutex_);
+    return false;
+  }
+  Queued queued = {session, GetTimeNS() + max_wait_ns_};
+  queue_.push_back(queued);
+  pthread_cond_signal(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  return true;
+}
+
+bool WorkerPool::Saturated() {
+  pthread_mutex_lock(&mutex_);
+  bool saturated = SaturatedLocked();
+  pthread_mutex_unlock(&mutex_);
+  return saturated;
+}
+
+void WorkerPool::ExpireQueued() {
+  std::vector<Session*> expired;
+  pthread_mutex_lock(&mutex_);
+  TakeExpiredLocked(&expired);
+  pthread_mutex_unlock(&mutex_);
+  for (size_t i = 0; i < expired.size(); ++i) {
+    std::cout << "no worker free in time, rejecting test" << std::endl;
+    RejectSession(expired[i]);
+  }
+}
+
+bool WorkerPool::SaturatedLocked() const {
+  // Queued sessions are picked up by idle workers first. Ones past their
+  // deadline are about to be rejected.
+  uint32_t idle = 0;
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    if (!workers_[i].busy)
+      ++idle;
+  }
+  const uint64_t now = GetTimeNS();
+  uint32_t waiting = 0;
+  for (size_t i = 0; i < queue_.size(); ++i) {
+    if (queue_[i].deadline_ns >= now)
+      ++waiting;
+  }
+  return waiting >= max_queued_ + idle;
+}
+
+void WorkerPool::TakeExpiredLocked(std::vector<Session*>* expired) {
+  const uint64_t now = GetTimeNS();
+  std::deque<Queued>::iterator it = queue_.begin();
+  while (it != queue_.end()) {
+    if (it->deadline_ns < now) {
+      expired->push_back(it->session);
+      ++rejected_;
+      it = queue_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void WorkerPool::PrintStats() {
+  pthread_mutex_lock(&mutex_);
+  std::cout << "workers: " << workers_.size() << " queued: " << queue_.size()
+            << " rejected: " << rejected_ << "\n";
+  for (uint32_t i = 0; i < workers_.size(); ++i) {
+    const Worker& worker = workers_[i];
+    std::cout << "  worker " << i << " cpu " << worker.cpu
+              << " sessions_run " << worker.sessions_run
+              << " busy_ms " << worker.busy_ns / (NS_PER_SEC / MS_PER_SEC)
+              << (worker.busy ? " (running)" : "") << "\n";
+  }
+  std::cout << std::flush;
+  pthread_mutex_unlock(&mutex_);
+}
+
+// static
+void* WorkerPool::WorkerThread(void* worker) {
+  Worker* self = reinterpret_cast<Worker*>(worker);
+  self->pool->Work(self);
+  return NULL;
+}
+
+void WorkerPool::Work(Worker* worker) {
+  pthread_mutex_lock(&mutex_);
+  while (true) {
+    while (queue_.empty() && !stopping_)
+      pthread_cond_wait(&cond_, &mutex_);
+    if (stopping_)
+      break;
+    std::vector<Session*> expired;
+    TakeExpiredLocked(&expired);
+    if (!expired.empty()) {
+      pthread_mutex_unlock(&mutex_);
+      for (size_t i = 0; i < expired.size(); ++i) {
+        std::cout << "no worker free in time, rejecting test" << std::endl;
+        RejectSession(expired[i]);
+      }
+      pthread_mutex_lock(&mutex_);
+      continue;
+    }
+    Session* session = queue_.front().session;
+    queue_.pop_front();
+    worker->busy = true;
+    pthread_mutex_unlock(&mutex_);
+
+    uint64_t start = GetTimeNS();
+    RunSession(session);
+    uint64_t busy_ns = GetTimeNS() - start;
+
+    pthread_mutex_lock(&mutex_);
+    worker->busy = false;
+    ++worker->sessions_run;
+    worker->busy_ns += busy_ns;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+}  // namespace mbm
@@ -0,0 +1,72 @@
+#ifndef SERVER_WORKER_POOL_H
+#define SERVER_WORKER_POOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+namespace mbm {
+struct Session;
+
+// A fixed set of pacing threads, optionally pinned one per CPU, that run
+// sessions handed over by the control reactor. Sessions wait in a bounded
+// queue while every worker is busy, but only for max_wait_ns: their client
+// already has READY and gives up if the test doesn't start soon after.
+// Sessions that wait longer are rejected with RejectSession().
+class WorkerPool {
+  public:
+    WorkerPool(uint32_t num_workers, uint32_t max_queued, uint64_t max_wait_ns,
+               bool pin);
+    ~WorkerPool();
+
+    bool Start();
+    // Takes ownership of the session unless it returns false, which it does
+    // when the queue is full.
+    bool Submit(Session* session);
+    // True if Submit would fail right now. Sessions that have waited too long
+    // don't count.
+    bool Saturated();
+    // Rejects the queued sessions that have waited too long. Workers skip
+    // them too, but only once one is free.
+    void ExpireQueued();
+    // One line per worker: sessions run, time busy, CPU.
+    void PrintStats();
+
+  private:
+    struct Worker {
+      WorkerPool* pool;
+      int cpu;
+      pthread_t thread;
+      bool started;
+      bool busy;
+      uint64_t sessions_run;
+      uint64_t busy_ns;
+    };
+
+    struct Queued {
+      Session* session;
+      uint64_t deadline_ns;
+    };
+
+    bool SaturatedLocked() const;
+    // Moves the queued sessions past their deadline to expired.
+    void TakeExpiredLocked(std::vector<Session*>* expired);
+    static void* WorkerThread(void* worker);
+    void Work(Worker* worker);
+
+    uint32_t max_queued_;
+    uint64_t max_wait_ns_;
+    bool pin_;
+    bool stopping_;
+    std::vector<Worker> workers_;
+    std::deque<Queued> queue_;
+    uint64_t rejected_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t cond_;
+};
+
+}  // namespace mbm
+
+#endif  // SERVER_WORKER_POOL_H
@@ -0,0 +1,91 @@
+#include "tools/analysis.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace mbm {
+namespace {
+// Marks a seq_no the server never sent.
+const uint32_t kNotSent = 0xffffffff;
+
+int64_t Percentile(std::vector<int64_t>* values, unsigned percent) {
+  size_t n = (values->size() - 1) * percent / 100;
+  std::nth_element(values->begin(), values->begin() + n, values->end());
+  return (*values)[n];
+}
+}  // namespace
+
+void AnalyzeTest(const ColumnView& server, const ColumnView& client,
+                 TestStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+
+  // Index the server's records by seq_no. The server numbers them from 0, so
+  // a seq_no past the number of records can only be corruption, and sizing
+  // the index by it could take gigabytes.
+  std::vector<uint32_t> sent(server.size, kNotSent);
+  for (size_t i = 0; i < server.size; ++i) {
+    if (server.seq_no[i] >= server.size) {
+      ++stats->invalid;
+      continue;
+    }
+    sent[server.seq_no[i]] = i;
+  }
+  for (size_t i = 0; i < sent.size(); ++i) {
+    if (sent[i] != kNotSent)
+      ++stats->packets_sent;
+  }
+
+  std::vector<bool> received(sent.size(), false);
+  std::vector<int64_t> delays;
+  delays.reserve(client.size);
+  uint32_t highest = 0;
+  bool any = false;
+  for (size_t i = 0; i < client.size; ++i) {
+    uint32_t seq_no = client.seq_no[i];
+    if (seq_no >= sent.size() || sent[seq_no] == kNotSent ||
+        server.nonce[sent[seq_no]] != client.nonce[i]) {
+      ++stats->invalid;
+      continue;
+    }
+    if (received[seq_no]) {
+      ++stats->duplicates;
+      continue;
+    }
+    received[seq_no] = true;
+    ++stats->packets_received;
+    if (any && seq_no < highest)
+      ++stats->reordered;
+    highest = std::max(highest, seq_no);
+    any = true;
+    delays.push_back(static_cast<int64_t>(client.timestamp[i]) -
+                     static_cast<int64_t>(server.timestamp[sent[seq_no]]));
+  }
+  stats->lost = stats->packets_sent - stats->packets_received;
+
+  if (!delays.empty()) {
+    int64_t min = *std::min_element(delays.begin(), delays.end());
+    int64_t max = *std::max_element(delays.begin(), delays.end());
+    stats->delay_max_ns = max - min;
+    stats->delay_p50_ns = Percentile(&delays, 50) - min;
+    stats->delay_p99_ns = Percentile(&delays, 99) - min;
+  }
+}
+
+void PrintStatsHeader(std::ostream& out) {
+  out << "sent\treceived\tlost\tloss_rate\treordered\tduplicates\tinvalid"
+      << "\tdelay_p50_ns\tdelay_p99_ns\tdelay_max_ns";
+}
+
+void PrintStats(const TestStats& stats, std::ostream& out) {
+  double loss_rate = stats.packets_sent == 0 ? 0.0 :
+      static_cast<double>(stats.lost) / stats.packets_sent;
+  out << stats.packets_sent << '\t' << stats.packets_received << '\t'
+      << stats.lost << '\t' << loss_rate << '\t' << stats.reordered << '\t'
+      << stats.duplicates << '\t' << stats.invalid << '\t'
+      << stats.delay_p50_ns << '\t' << stats.delay_p99_ns << '\t'
+      << stats.delay_max_ns;
+}
+
+}  // namespace mbm
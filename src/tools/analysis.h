@@ -0,0 +1,43 @@
+#ifndef TOOLS_ANALYSIS_H
+#define TOOLS_ANALYSIS_H
+
+#include <stdint.h>
+
+#include <ostream>
+
+#include "common/log_file.h"
+
+namespace mbm {
+
+// What one test's records say about the path. The clocks of the server and
+// the client aren't synchronized, so one-way delays are reported relative to
+// the smallest one seen in the test.
+struct TestStats {
+  uint64_t packets_sent;
+  // Distinct packets the client reported, with the right nonce.
+  uint64_t packets_received;
+  uint64_t lost;
+  // Packets that arrived after one with a higher seq_no.
+  uint64_t reordered;
+  uint64_t duplicates;
+  // Client records for packets that were never sent, or with the wrong
+  // nonce, and server records with a seq_no past the number of them.
+  uint64_t invalid;
+  int64_t delay_p50_ns;
+  int64_t delay_p99_ns;
+  int64_t delay_max_ns;
+};
+
+// Joins the client's records with the server's by seq_no, checking the
+// nonce, and fills in stats. The server's records are indexed by seq_no,
+// which has to be less than the number of them.
+void AnalyzeTest(const ColumnView& server, const ColumnView& client,
+                 TestStats* stats);
+
+// Column names for PrintStats, tab separated.
+void PrintStatsHeader(std::ostream& out);
+void PrintStats(const TestStats& stats, std::ostream& out);
+
+}  // namespace mbm
+
+#endif  // TOOLS_ANALYSIS_H
@@ -0,0 +1,251 @@
+// Walks a tree of mbm_server logs, in any of the formats it writes, and
+// prints loss, reordering, duplicate and one-way delay statistics for every
+// test, one line each. Tests are analyzed in parallel.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common/constants.h"
+#include "common/log_file.h"
+#include "common/segment_store.h"
+#include "common/time.h"
+#include "gflags/gflags.h"
+#include "tools/analysis.h"
+#include "tools/work_stealing.h"
+
+DEFINE_int32(threads, 0, "The number of analysis threads. 0 uses one per "
+                         "CPU");
+DEFINE_string(output, "", "Where to write the statistics. Empty writes to "
+                          "stdout");
+
+namespace {
+bool ValidateNonNegative(const char* flagname, int32_t value) {
+  if (value >= 0)
+    return true;
+  std::cerr << "Invalid value for --" << flagname << ": " << value << "\n";
+  return false;
+}
+}  // namespace
+
+DEFINE_validator(threads, ValidateNonNegative);
+
+namespace mbm {
+namespace {
+const char kServerTextSuffix[] = "_serverdata";
+const char kClientTextSuffix[] = "_clientdata";
+
+// One test to analyze, and its results.
+struct Task {
+  // Printed at the start of the test's line.
+  std::string name;
+  std::string path;
+  // Text logs only: the client's records; path holds the server's.
+  std::string client_path;
+  // Segments only: where the test's log is.
+  uint64_t offset;
+  uint64_t size;
+
+  bool ok;
+  TestStats stats;
+};
+
+bool EndsWith(const std::string& value, const char* suffix) {
+  const size_t suffix_len = strlen(suffix);
+  return value.size() >= suffix_len &&
+         value.compare(value.size() - suffix_len, suffix_len, suffix) == 0;
+}
+
+std::string StripSuffix(const std::string& value, const char* suffix) {
+  return value.substr(0, value.size() - strlen(suffix));
+}
+
+void AddTask(const std::string& name, const std::string& path,
+             std::vector<Task>* tasks) {
+  Task task;
+  task.name = name;
+  task.path = path;
+  task.offset = 0;
+  task.size = 0;
+  task.ok = false;
+  tasks->push_back(task);
+}
+
+void AddSegment(const std::string& path, std::vector<Task>* tasks) {
+  SegmentIndex index;
+  if (!index.Open(path))
+    return;
+  for (size_t i = 0; i < index.size(); ++i) {
+    const SegmentIndexEntry& entry = index.entry(i);
+    timespec time = {static_cast<time_t>(entry.time_ns / NS_PER_SEC),
+                     static_cast<long>(entry.time_ns % NS_PER_SEC)};
+    AddTask(path + ':' + LogName(time), path, tasks);
+    tasks->back().offset = entry.offset;
+    tasks->back().size = entry.size;
+  }
+}
+
+// Collects the tests under directory, in name order. A test logged both
+// ways (converted with mbm_log_to_text) is only taken from its binary log.
+void Walk(const std::string& directory, std::vector<Task>* tasks) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL) {
+    std::cerr << "failed to open " << directory << ": " << strerror(errno)
+              << "\n";
+    return;
+  }
+  std::vector<std::string> names;
+  while (dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+      names.push_back(entry->d_name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  const std::set<std::string> name_set(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::string& name = names[i];
+    const std::string path = directory + '/' + name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      Walk(path, tasks);
+    } else if (EndsWith(name, kLogFileSuffix)) {
+      AddTask(StripSuffix(path, kLogFileSuffix), path, tasks);
+    } else if (EndsWith(name, kSegmentSuffix)) {
+      AddSegment(path, tasks);
+    } else if (EndsWith(name, kServerTextSuffix)) {
+      const std::string prefix = StripSuffix(name, kServerTextSuffix);
+      if (name_set.count(prefix + kLogFileSuffix) != 0 ||
+          name_set.count(prefix + kClientTextSuffix) == 0)
+        continue;
+      AddTask(directory + '/' + prefix, path, tasks);
+      tasks->back().client_path = directory + '/' + prefix + kClientTextSuffix;
+    }
+  }
+}
+
+// Parses "seq_no nonce timestamp" lines straight out of the mapped file.
+bool LoadTextRecords(const std::string& path, RecordColumns* records) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char* p = static_cast<const char*>(map);
+  const char* const end = p + st.st_size;
+  records->Reserve(st.st_size / 32);
+  bool ok = true;
+  while (p < end && ok) {
+    uint64_t fields[3];
+    for (int f = 0; f < 3; ++f) {
+      while (p < end && (*p == ' ' || *p == '\n'))
+        ++p;
+      if (p == end || *p < '0' || *p > '9') {
+        // Trailing whitespace is fine; anything else isn't.
+        ok = (p == end && f == 0);
+        break;
+      }
+      uint64_t value = 0;
+      while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+      fields[f] = value;
+      if (f == 2)
+        records->Append(fields[0], fields[1], fields[2]);
+    }
+  }
+  munmap(map, st.st_size);
+  return ok;
+}
+
+void AnalyzeTask(size_t index, void* arg) {
+  Task& task = (*static_cast<std::vector<Task>*>(arg))[index];
+  if (!task.client_path.empty()) {
+    RecordColumns server;
+    RecordColumns client;
+    task.ok = LoadTextRecords(task.path, &server) &&
+              LoadTextRecords(task.client_path, &client);
+    if (task.ok)
+      AnalyzeTest(server.view(), client.view(), &task.stats);
+  } else {
+    LogFile log;
+    task.ok = log.Open(task.path, task.offset, task.size);
+    if (task.ok)
+      AnalyzeTest(log.server(), log.client(), &task.stats);
+  }
+}
+}  // namespace
+}  // namespace mbm
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage("mbm_analyze [--threads=N] <log directory>...");
+  gflags::SetVersionString(MBM_VERSION);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    gflags::ShowUsageWithFlags(argv[0]);
+    return 1;
+  }
+
+  using namespace mbm;
+
+  uint64_t start_ns = GetTimeNS();
+  std::vector<Task> tasks;
+  for (int i = 1; i < argc; ++i)
+    Walk(argv[i], &tasks);
+
+  size_t num_threads = FLAGS_threads;
+  if (num_threads == 0)
+    num_threads = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  WorkStealingPool pool(num_threads);
+  pool.Run(tasks.size(), &AnalyzeTask, &tasks);
+
+  std::ofstream file;
+  if (!FLAGS_output.empty())
+    file.open(FLAGS_output.c_str());
+  std::ostream& out = FLAGS_output.empty() ? std::cout : file;
+  out << "test\t";
+  PrintStatsHeader(out);
+  out << '\n';
+  size_t failed = 0;
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    if (!tasks[i].ok) {
+      std::cerr << "failed to read " << tasks[i].name << "\n";
+      ++failed;
+      continue;
+    }
+    out << tasks[i].name << '\t';
+    PrintStats(tasks[i].stats, out);
+    out << '\n';
+  }
+  out.flush();
+
+  std::cerr << "analyzed " << tasks.size() - failed << " tests ("
+            << failed << " failed) on " << num_threads << " threads in "
+            << (GetTimeNS() - start_ns) / (NS_PER_SEC / MS_PER_SEC)
+            << " ms, " << pool.stolen() << " stolen\n";
+  return failed == 0 && out ? 0 : 1;
+}
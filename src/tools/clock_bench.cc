@@ -0,0 +1,84 @@
+// Compares the clock sources GetTimeNS() can read: what a call costs, and
+// with the TSC, how far it strays from the system clock over a while.
+
+#include <stdint.h>
+
+#include <iostream>
+
+#include "common/constants.h"
+#include "common/time.h"
+#include "gflags/gflags.h"
+
+DEFINE_uint64(calls, 10000000, "How many calls to time for each source");
+DEFINE_uint64(drift_sec, 5, "How long to compare the TSC clock with the "
+                            "system clock for");
+
+namespace mbm {
+namespace {
+// Sums the readings so the calls can't be optimized away.
+uint64_t sink = 0;
+
+double NsPerCall(uint64_t (*clock)()) {
+  uint64_t start_ns = GetSystemTimeNS();
+  for (uint64_t i = 0; i < FLAGS_calls; ++i)
+    sink += clock();
+  return static_cast<double>(GetSystemTimeNS() - start_ns) / FLAGS_calls;
+}
+
+// Largest distance between the two clocks, sampled every 10 ms.
+int64_t MaxDrift() {
+  int64_t max_drift_ns = 0;
+  const uint64_t end_ns = GetSystemTimeNS() + FLAGS_drift_sec * NS_PER_SEC;
+  while (GetSystemTimeNS() < end_ns) {
+    NanoSleepX(0, 10 * (NS_PER_SEC / MS_PER_SEC));
+    // How far the TSC reading is outside the system readings around it; the
+    // tightest of a few tries, so preemption doesn't count as drift.
+    int64_t drift_ns = 0;
+    for (int i = 0; i < 5; ++i) {
+      uint64_t before_ns = GetSystemTimeNS();
+      uint64_t tsc_ns = GetTimeNS();
+      uint64_t after_ns = GetSystemTimeNS();
+      int64_t outside_ns = 0;
+      if (tsc_ns < before_ns)
+        outside_ns = before_ns - tsc_ns;
+      else if (tsc_ns > after_ns)
+        outside_ns = tsc_ns - after_ns;
+      if (i == 0 || outside_ns < drift_ns)
+        drift_ns = outside_ns;
+    }
+    if (drift_ns > max_drift_ns)
+      max_drift_ns = drift_ns;
+  }
+  return max_drift_ns;
+}
+}  // namespace
+}  // namespace mbm
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage("mbm_clock_bench [--calls=N] [--drift_sec=N]");
+  gflags::SetVersionString(MBM_VERSION);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  using namespace mbm;
+
+  std::cout.setf(std::ios_base::fixed);
+  std::cout.precision(1);
+  std::cout << "system: " << NsPerCall(&GetSystemTimeNS) << " ns/call\n";
+
+  if (SetClockSource(CLOCK_SOURCE_TSC) != CLOCK_SOURCE_TSC) {
+    std::cout << "tsc: not usable on this machine\n";
+    return 0;
+  }
+  int64_t error_ns, max_error_ns;
+  GetClockError(&error_ns, &max_error_ns);
+  std::cout << "tsc: calibrated " << error_ns << " ns off\n";
+  std::cout << "tsc: " << NsPerCall(&GetTimeNS) << " ns/call\n";
+  int64_t drift_ns = MaxDrift();
+  GetClockError(&error_ns, &max_error_ns);
+  std::cout << "tsc: at most " << drift_ns << " ns from the system clock over "
+            << FLAGS_drift_sec << " s, calibration error at most "
+            << max_error_ns << " ns\n";
+  if (GetClockSource() != CLOCK_SOURCE_TSC)
+    std::cout << "tsc: fell back to the system clock\n";
+  return sink == 0;
+}
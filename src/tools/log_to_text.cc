@@ -0,0 +1,98 @@
+// Converts the binary test logs written by mbm_server back to the text
+// _testdata, _serverdata and _clientdata files. Segments are split into one
+// set of files per test, next to the segment.
+
+#include <string.h>
+
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include "common/constants.h"
+#include "common/log_file.h"
+#include "common/segment_store.h"
+#include "gflags/gflags.h"
+
+DEFINE_bool(testdata, false, "Also write the _testdata file");
+DEFINE_uint64(from_sec, 0, "Only convert the tests in a segment logged at or "
+                           "after this time, in seconds since the epoch");
+DEFINE_uint64(to_sec, 0, "Only convert the tests in a segment logged before "
+                         "this time, in seconds since the epoch. 0 is no "
+                         "limit");
+
+namespace mbm {
+namespace {
+bool EndsWith(const std::string& value, const char* suffix) {
+  const size_t suffix_len = strlen(suffix);
+  return value.size() >= suffix_len &&
+         value.compare(value.size() - suffix_len, suffix_len, suffix) == 0;
+}
+
+bool WriteText(const LogFile& log, const std::string& prefix) {
+  if (FLAGS_testdata) {
+    std::ofstream fs_test((prefix + "_testdata").c_str());
+    fs_test.write(log.testdata(), log.testdata_size());
+    fs_test.close();
+    if (!fs_test) {
+      std::cerr << "failed to write " << prefix << "_testdata\n";
+      return false;
+    }
+  }
+  return WriteTextRecords(prefix + "_serverdata", log.server()) &&
+         WriteTextRecords(prefix + "_clientdata", log.client());
+}
+
+bool ConvertSegment(const std::string& path) {
+  SegmentIndex index;
+  if (!index.Open(path))
+    return false;
+  const std::string directory = path.substr(0, path.rfind('/') + 1);
+
+  const uint64_t to_ns = FLAGS_to_sec == 0 ?
+      std::numeric_limits<uint64_t>::max() : FLAGS_to_sec * NS_PER_SEC;
+  for (size_t i = index.LowerBound(FLAGS_from_sec * NS_PER_SEC);
+       i < index.size() && index.entry(i).time_ns < to_ns; ++i) {
+    const SegmentIndexEntry& entry = index.entry(i);
+    LogFile log;
+    if (!log.Open(path, entry.offset, entry.size))
+      return false;
+    timespec time = {static_cast<time_t>(entry.time_ns / NS_PER_SEC),
+                     static_cast<long>(entry.time_ns % NS_PER_SEC)};
+    if (!WriteText(log, directory + LogName(time)))
+      return false;
+  }
+  return true;
+}
+
+bool Convert(const std::string& path) {
+  if (EndsWith(path, kSegmentSuffix))
+    return ConvertSegment(path);
+  if (!EndsWith(path, kLogFileSuffix)) {
+    std::cerr << path << ": expected a name ending in " << kLogFileSuffix
+              << " or " << kSegmentSuffix << "\n";
+    return false;
+  }
+  LogFile log;
+  return log.Open(path) &&
+         WriteText(log, path.substr(0, path.size() - strlen(kLogFileSuffix)));
+}
+}  // namespace
+}  // namespace mbm
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage("mbm_log_to_text [--testdata] <log or segment>...");
+  gflags::SetVersionString(MBM_VERSION);
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 2) {
+    gflags::ShowUsageWithFlags(argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!mbm::Convert(argv[i]))
+      ++failed;
+  }
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+#include "tools/work_stealing.h"
+
+#include <string.h>
+
+#include <iostream>
+
+namespace mbm {
+
+WorkStealingPool::WorkStealingPool(size_t num_threads)
+    : workers_(num_threads > 0 ? num_threads : 1),
+      fn_(NULL),
+      arg_(NULL),
+      stolen_(0) {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i].pool = this;
+    workers_[i].index = i;
+    pthread_mutex_init(&workers_[i].mutex, NULL);
+  }
+  pthread_mutex_init(&stats_mutex_, NULL);
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  for (size_t i = 0; i < workers_.size(); ++i)
+    pthread_mutex_destroy(&workers_[i].mutex);
+  pthread_mutex_destroy(&stats_mutex_);
+}
+
+bool WorkStealingPool::Run(size_t num_tasks, TaskFunction fn, void* arg) {
+  fn_ = fn;
+  arg_ = arg;
+  // No thread is running yet, so the deques are filled without locking.
+  for (size_t task = 0; task < num_tasks; ++task)
+    workers_[task % workers_.size()].tasks.push_back(task);
+
+  // The calling thread is worker 0.
+  size_t started = 1;
+  for (; started < workers_.size(); ++started) {
+    int rc = pthread_create(&workers_[started].thread, NULL, WorkerThread,
+                            &workers_[started]);
+    if (rc != 0) {
+      // The others steal this worker's tasks.
+      std::cerr << "Failed to create thread: " << strerror(rc) << " ["
+                << rc << "]\n";
+      break;
+    }
+  }
+  Work(&workers_[0]);
+  for (size_t i = 1; i < started; ++i)
+    pthread_join(workers_[i].thread, NULL);
+
+  // The running workers steal from the ones that never started, but they may
+  // all have finished before a straggler was dealt; pick those up here.
+  for (size_t i = started; i < workers_.size(); ++i) {
+    size_t task;
+    while (Pop(&workers_[i], &task))
+      fn_(task, arg_);
+  }
+  return true;
+}
+
+// static
+void* WorkStealingPool::WorkerThread(void* worker) {
+  Worker* self = reinterpret_cast<Worker*>(worker);
+  self->pool->Work(self);
+  return NULL;
+}
+
+void WorkStealingPool::Work(Worker* worker) {
+  size_t task;
+  while (Pop(worker, &task) || Steal(worker, &task))
+    fn_(task, arg_);
+}
+
+bool WorkStealingPool::Pop(Worker* worker, size_t* task) {
+  pthread_mutex_lock(&worker->mutex);
+  bool found = !worker->tasks.empty();
+  if (found) {
+    *task = worker->tasks.back();
+    worker->tasks.pop_back();
+  }
+  pthread_mutex_unlock(&worker->mutex);
+  return found;
+}
+
+bool WorkStealingPool::Steal(Worker* thief, size_t* task) {
+  // Tasks are never added once Run starts, so one pass that finds every
+  // deque empty means there's nothing left to do.
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker& victim = workers_[(thief->index + i) % workers_.size()];
+    pthread_mutex_lock(&victim.mutex);
+    bool found = !victim.tasks.empty();
+    if (found) {
+      *task = victim.tasks.front();
+      victim.tasks.pop_front();
+    }
+    pthread_mutex_unlock(&victim.mutex);
+    if (found) {
+      pthread_mutex_lock(&stats_mutex_);
+      ++stolen_;
+      pthread_mutex_unlock(&stats_mutex_);
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace mbm
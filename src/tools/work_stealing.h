@@ -0,0 +1,52 @@
+#ifndef TOOLS_WORK_STEALING_H
+#define TOOLS_WORK_STEALING_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <deque>
+#include <vector>
+
+namespace mbm {
+
+// Runs numbered tasks on a fixed set of threads. Tasks are dealt out round
+// robin; each thread works through its own deque from the back and, once it
+// runs dry, steals from the front of the others', so a few expensive tasks
+// don't leave the other threads idle.
+class WorkStealingPool {
+  public:
+    typedef void (*TaskFunction)(size_t task, void* arg);
+
+    explicit WorkStealingPool(size_t num_threads);
+    ~WorkStealingPool();
+
+    // Runs fn(i, arg) for every i below num_tasks and returns when all are
+    // done. fn must be safe to call from several threads at once.
+    bool Run(size_t num_tasks, TaskFunction fn, void* arg);
+    // Tasks run by a thread other than the one they were dealt to.
+    size_t stolen() const { return stolen_; }
+
+  private:
+    struct Worker {
+      WorkStealingPool* pool;
+      size_t index;
+      pthread_t thread;
+      pthread_mutex_t mutex;
+      std::deque<size_t> tasks;
+    };
+
+    static void* WorkerThread(void* worker);
+    void Work(Worker* worker);
+    bool Pop(Worker* worker, size_t* task);
+    bool Steal(Worker* thief, size_t* task);
+
+    std::vector<Worker> workers_;
+    TaskFunction fn_;
+    void* arg_;
+    size_t stolen_;
+    pthread_mutex_t stats_mutex_;
+};
+
+}  // namespace mbm
+
+#endif  // TOOLS_WORK_STEALING_H